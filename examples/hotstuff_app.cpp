@@ -20,6 +20,7 @@
 #include <cassert>
 #include <algorithm>
 #include <random>
+#include <deque>
 #include <unistd.h>
 #include <signal.h>
 
@@ -60,12 +61,17 @@ using hotstuff::DataStream;
 using hotstuff::ReplicaID;
 using hotstuff::MsgReqCmd;
 using hotstuff::MsgRespCmd;
+using hotstuff::MsgReqCmdBatch;
+using hotstuff::MsgRespCmdBatch;
 using hotstuff::get_hash;
 using hotstuff::promise_t;
 
 using HotStuff = hotstuff::HotStuffSecp256k1;
 
 class HotStuffApp: public HotStuff {
+    using ClientNet = ClientNetwork<opcode_t>;
+    using client_conn_t = ClientNet::conn_t;
+
     double stat_period;
     double impeach_timeout;
     EventContext ec;
@@ -75,8 +81,25 @@ class HotStuffApp: public HotStuff {
     /** Timer object to monitor the progress for simple impeachment */
     TimerEvent impeach_timer;
     /** The listen address for client RPC */
+    NetAddr clisten_addr;
+    /** Network messaging between a replica and its client */
+    ClientNet cn;
 
     std::unordered_map<const uint256_t, promise_t> unconfirmed;
+    struct ClientWaiting {
+        double t;
+        std::vector<NetAddr> addrs;
+    };
+    /** clients waiting for the decision of each command; commands reach
+     * the chain through the coordinator, so a command may never be decided
+     * and its entry has to expire */
+    std::unordered_map<const uint256_t, ClientWaiting> client_waiting;
+    /** client_waiting insertions, oldest first */
+    std::deque<std::pair<double, uint256_t>> client_waiting_order;
+    static constexpr size_t max_client_waiting = 1 << 20;
+    static constexpr double client_waiting_timeout = 60;
+    /** decisions of the block being committed, by client */
+    std::unordered_map<NetAddr, std::vector<Finality>> resp_pending;
    
 
     /* for the dedicated thread sending responses to the clients */
@@ -87,6 +110,61 @@ class HotStuffApp: public HotStuff {
         return cmd;
     }
 
+    /* drop the entries that are too old, or the oldest ones beyond the cap */
+    void expire_client_waiting(double now) {
+        while (!client_waiting_order.empty())
+        {
+            const auto &e = client_waiting_order.front();
+            if (e.first > now - client_waiting_timeout &&
+                client_waiting_order.size() <= max_client_waiting)
+                break;
+            auto it = client_waiting.find(e.second);
+            /* skip if answered (and possibly re-added) in the meantime */
+            if (it != client_waiting.end() && it->second.t == e.first)
+                client_waiting.erase(it);
+            client_waiting_order.pop_front();
+        }
+    }
+
+    void add_client_cmd(const command_t &cmd, const client_conn_t &conn) {
+        double now = hotstuff::get_mono_time();
+        expire_client_waiting(now);
+        const auto &cmd_hash = cmd->get_hash();
+        auto it = client_waiting.find(cmd_hash);
+        if (it == client_waiting.end())
+        {
+            it = client_waiting.insert(
+                std::make_pair(cmd_hash, ClientWaiting{now, {}})).first;
+            client_waiting_order.push_back(std::make_pair(now, cmd_hash));
+        }
+        it->second.addrs.push_back(conn->get_peer_addr());
+    }
+
+    bool client_conn_handler(const salticidae::ConnPool::conn_t &conn, bool connected) {
+        if (connected) return true;
+        const auto &addr = conn->get_peer_addr();
+        for (auto it = client_waiting.begin(); it != client_waiting.end();)
+        {
+            auto &addrs = it->second.addrs;
+            addrs.erase(std::remove(addrs.begin(), addrs.end(), addr), addrs.end());
+            if (addrs.empty())
+                it = client_waiting.erase(it);
+            else
+                it++;
+        }
+        resp_pending.erase(addr);
+        return true;
+    }
+
+    void client_request_cmd_handler(MsgReqCmd &&msg, const client_conn_t &conn) {
+        add_client_cmd(parse_cmd(msg.serialized), conn);
+    }
+
+    void client_request_cmd_batch_handler(MsgReqCmdBatch &&msg, const client_conn_t &conn) {
+        for (uint32_t i = 0; i < msg.ncmd; i++)
+            add_client_cmd(parse_cmd(msg.serialized), conn);
+    }
+
     void reset_imp_timer() {
         impeach_timer.del();
         impeach_timer.add(impeach_timeout);
@@ -97,6 +175,23 @@ class HotStuffApp: public HotStuff {
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
         HOTSTUFF_LOG_INFO("replicated %s", std::string(fin).c_str());
 #endif
+        auto it = client_waiting.find(fin.cmd_hash);
+        if (it == client_waiting.end()) return;
+        for (const auto &addr: it->second.addrs)
+            resp_pending[addr].push_back(fin);
+        client_waiting.erase(it);
+    }
+
+    /* answer each client once per committed block */
+    void do_decide_blk(const hotstuff::block_t &) override {
+        for (const auto &p: resp_pending)
+        {
+            if (p.second.size() == 1)
+                cn.send_msg(MsgRespCmd(p.second[0]), p.first);
+            else
+                cn.send_msg(MsgRespCmdBatch(p.second), p.first);
+        }
+        resp_pending.clear();
     }
 
 
@@ -111,6 +206,7 @@ class HotStuffApp: public HotStuff {
                 hotstuff::pacemaker_bt pmaker,
                 const EventContext &ec,
                 size_t nworker,
+                const std::vector<int> &worker_cpus,
                 const Net::Config &repnet_config,
                 const ClientNetwork<opcode_t>::Config &clinet_config);
 
@@ -152,7 +248,22 @@ int main(int argc, char **argv) {
     auto opt_base_timeout = Config::OptValDouble::create(1);
     auto opt_prop_delay = Config::OptValDouble::create(1);
     auto opt_imp_timeout = Config::OptValDouble::create(11);
+    auto opt_hb_interval = Config::OptValDouble::create(0);
+    auto opt_hb_phi = Config::OptValDouble::create(8);
+    auto opt_timeout_pct = Config::OptValDouble::create(0.99);
+    auto opt_min_timeout = Config::OptValDouble::create(0.05);
+    auto opt_max_timeout = Config::OptValDouble::create(10);
+    auto opt_rep_window = Config::OptValInt::create(100);
+    auto opt_tree_fanout = Config::OptValInt::create(0);
+    auto opt_ec_threshold = Config::OptValInt::create(0);
+    auto opt_fetch_window = Config::OptValDouble::create(0);
+    auto opt_fetch_range = Config::OptValInt::create(0);
+    auto opt_bulk_rate = Config::OptValDouble::create(0);
+    auto opt_tree_agg_timeout = Config::OptValDouble::create(0.05);
+    auto opt_tree_timeout = Config::OptValDouble::create(1);
     auto opt_nworker = Config::OptValInt::create(1);
+    auto opt_worker_cpus = Config::OptValStr::create();
+    auto opt_inline_depth = Config::OptValInt::create(1);
     auto opt_repnworker = Config::OptValInt::create(1);
     auto opt_repburst = Config::OptValInt::create(100);
     auto opt_clinworker = Config::OptValInt::create(8);
@@ -172,12 +283,27 @@ int main(int argc, char **argv) {
     config.add_opt("privkey", opt_privkey, Config::SET_VAL);
     config.add_opt("tls-privkey", opt_tls_privkey, Config::SET_VAL);
     config.add_opt("tls-cert", opt_tls_cert, Config::SET_VAL);
-    config.add_opt("pace-maker", opt_pace_maker, Config::SET_VAL, 'p', "specify pace maker (dummy, rr)");
+    config.add_opt("pace-maker", opt_pace_maker, Config::SET_VAL, 'p', "specify pace maker (dummy, rr, rr-adaptive, rr-rep, rr-block, tree)");
     config.add_opt("proposer", opt_fixed_proposer, Config::SET_VAL, 'l', "set the fixed proposer (for dummy)");
     config.add_opt("base-timeout", opt_base_timeout, Config::SET_VAL, 't', "set the initial timeout for the Round-Robin Pacemaker");
     config.add_opt("prop-delay", opt_prop_delay, Config::SET_VAL, 't', "set the delay that follows the timeout for the Round-Robin Pacemaker");
-    config.add_opt("imp-timeout", opt_imp_timeout, Config::SET_VAL, 'u', "set impeachment timeout (for sticky)");
+    config.add_opt("timeout-pct", opt_timeout_pct, Config::SET_VAL, 'q', "set the latency percentile the adaptive timeout is derived from (for rr-adaptive)");
+    config.add_opt("min-timeout", opt_min_timeout, Config::SET_VAL, 'o', "set the lower bound of the adaptive timeout (for rr-adaptive)");
+    config.add_opt("max-timeout", opt_max_timeout, Config::SET_VAL, 'O', "set the upper bound of the adaptive timeout (for rr-adaptive)");
+    config.add_opt("rep-window", opt_rep_window, Config::SET_VAL, 'W', "set the number of committed heights over which proposer reputation is counted (for rr-rep)");
+    config.add_opt("imp-timeout", opt_imp_timeout, Config::SET_VAL, 'u', "set impeachment timeout (for sticky, also the backstop to heartbeats)");
+    config.add_opt("hb-interval", opt_hb_interval, Config::SET_VAL, 'H', "set the interval of heartbeats from the proposer (for rr, rr-adaptive and rr-rep; 0 to impeach on imp-timeout only)");
+    config.add_opt("hb-phi", opt_hb_phi, Config::SET_VAL, 'P', "set the suspicion level (phi) at which the proposer is impeached");
+    config.add_opt("tree-fanout", opt_tree_fanout, Config::SET_VAL, 'k', "disseminate proposals and aggregate votes over a tree of this fanout (0 for direct broadcast)");
+    config.add_opt("tree-agg-timeout", opt_tree_agg_timeout, Config::SET_VAL, 'g', "set how long an inner replica waits for the votes of its subtree");
+    config.add_opt("tree-timeout", opt_tree_timeout, Config::SET_VAL, 'T', "set the timeout before falling back to direct broadcast (for tree)");
+    config.add_opt("ec-threshold", opt_ec_threshold, Config::SET_VAL, 'e', "send proposals of at least this many bytes as erasure-coded chunks (0 to disable)");
+    config.add_opt("fetch-window", opt_fetch_window, Config::SET_VAL, 'f', "coalesce block requests/responses to the same replica within this window (in seconds)");
+    config.add_opt("fetch-range", opt_fetch_range, Config::SET_VAL, 'r', "request up to this many missing ancestors together with a block (0 to fetch them one by one)");
+    config.add_opt("bulk-rate", opt_bulk_rate, Config::SET_VAL, 'R', "limit block transfer to this many bytes per second (0 for no limit)");
     config.add_opt("nworker", opt_nworker, Config::SET_VAL, 'n', "the number of threads for verification");
+    config.add_opt("worker-cpus", opt_worker_cpus, Config::SET_VAL, 'w', "pin verification threads to the given cpus (comma-separated)");
+    config.add_opt("inline-depth", opt_inline_depth, Config::SET_VAL, 'x', "verify on the event loop while fewer than this many tasks are queued (0 to always offload)");
     config.add_opt("repnworker", opt_repnworker, Config::SET_VAL, 'm', "the number of threads for replica network");
     config.add_opt("repburst", opt_repburst, Config::SET_VAL, 'b', "");
     config.add_opt("clinworker", opt_clinworker, Config::SET_VAL, 'M', "the number of threads for client network");
@@ -223,9 +349,27 @@ int main(int argc, char **argv) {
     hotstuff::pacemaker_bt pmaker;
     if (opt_pace_maker->get() == "dummy")
         pmaker = new hotstuff::PaceMakerDummyFixed(opt_fixed_proposer->get(), parent_limit);
+    else if (opt_pace_maker->get() == "tree")
+        pmaker = new hotstuff::PaceMakerTree(ec, opt_fixed_proposer->get(), parent_limit, opt_tree_timeout->get());
+    else if (opt_pace_maker->get() == "rr-adaptive")
+        pmaker = new hotstuff::PaceMakerRRAdaptive(ec, parent_limit,
+                    opt_base_timeout->get(), opt_prop_delay->get(),
+                    opt_timeout_pct->get(),
+                    opt_min_timeout->get(), opt_max_timeout->get());
+    else if (opt_pace_maker->get() == "rr-block")
+        pmaker = new hotstuff::PaceMakerRotating(ec, parent_limit, opt_base_timeout->get());
+    else if (opt_pace_maker->get() == "rr-rep")
+        pmaker = new hotstuff::PaceMakerRRReputation(ec, parent_limit,
+                    opt_base_timeout->get(), opt_prop_delay->get(),
+                    opt_rep_window->get());
     else
         pmaker = new hotstuff::PaceMakerRR(ec, parent_limit, opt_base_timeout->get(), opt_prop_delay->get());
 
+    std::vector<int> worker_cpus;
+    if (!opt_worker_cpus->get().empty())
+        for (const auto &s: trim_all(split(opt_worker_cpus->get(), ",")))
+            worker_cpus.push_back(std::stoi(s));
+
     HotStuffApp::Net::Config repnet_config;
     ClientNetwork<opcode_t>::Config clinet_config;
     if (!opt_tls_privkey->get().empty() && !opt_notls->get())
@@ -257,8 +401,16 @@ int main(int argc, char **argv) {
                         std::move(pmaker),
                         ec,
                         opt_nworker->get(),
+                        worker_cpus,
                         repnet_config,
                         clinet_config);
+    papp->get_vpool().set_inline_depth(opt_inline_depth->get());
+    papp->set_tree_overlay(opt_tree_fanout->get(), opt_tree_agg_timeout->get());
+    papp->set_ec_threshold(opt_ec_threshold->get());
+    papp->set_blk_flush_window(opt_fetch_window->get());
+    papp->set_blk_range_limit(opt_fetch_range->get());
+    papp->set_bulk_rate(opt_bulk_rate->get());
+    papp->set_heartbeat(opt_hb_interval->get(), opt_hb_phi->get());
     papp->listen_port_for_coo = opt_coo_listen_port.get()->get();
     papp->send_port_for_coo = opt_coo_send_port.get()->get();
     papp->listen_port_for_iri = opt_iri_listen_port.get()->get();
@@ -294,13 +446,20 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
                         hotstuff::pacemaker_bt pmaker,
                         const EventContext &ec,
                         size_t nworker,
+                        const std::vector<int> &worker_cpus,
                         const Net::Config &repnet_config,
                         const ClientNetwork<opcode_t>::Config &clinet_config):
     HotStuff(blk_size, idx, raw_privkey,
             plisten_addr, std::move(pmaker), ec, nworker, repnet_config),
     stat_period(stat_period),
     impeach_timeout(impeach_timeout),
-    ec(ec){
+    ec(ec),
+    clisten_addr(clisten_addr),
+    cn(ec, clinet_config) {
+    vpool.pin_workers(worker_cpus);
+    cn.reg_handler(salticidae::generic_bind(&HotStuffApp::client_request_cmd_handler, this, _1, _2));
+    cn.reg_handler(salticidae::generic_bind(&HotStuffApp::client_request_cmd_batch_handler, this, _1, _2));
+    cn.reg_conn_handler(salticidae::generic_bind(&HotStuffApp::client_conn_handler, this, _1, _2));
 
 }
 
@@ -312,6 +471,9 @@ void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytea
         ev_stat_timer.add(stat_period);
     });
     ev_stat_timer.add(stat_period);
+    /* impeach the proposer when nothing is decided for a while, also when
+     * heartbeats are on: a live but stuck (or Byzantine) proposer keeps
+     * sending them */
     impeach_timer = TimerEvent(ec, [this](TimerEvent &) {
         get_pace_maker()->impeach();
         reset_imp_timer();
@@ -321,12 +483,15 @@ void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytea
     HOTSTUFF_LOG_INFO("blk_size = %lu", blk_size);
     HOTSTUFF_LOG_INFO("conns = %lu", HotStuff::size());
     HOTSTUFF_LOG_INFO("** starting the event loop...");
+    cn.start();
+    cn.listen(clisten_addr);
     HotStuff::start(reps);
    
     ec.dispatch();
 }
 
 void HotStuffApp::stop() {
+    cn.stop();
     ec.stop();
 }
 
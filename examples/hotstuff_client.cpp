@@ -17,8 +17,10 @@
 
 #include <cassert>
 #include <random>
+#include <atomic>
+#include <thread>
+#include <chrono>
 #include <signal.h>
-#include <sys/time.h>
 #include <iostream>
 #include "salticidae/type.h"
 #include "salticidae/netaddr.h"
@@ -36,87 +38,252 @@ using hotstuff::NetAddr;
 using hotstuff::EventContext;
 using hotstuff::MsgReqCmd;
 using hotstuff::MsgRespCmd;
+using hotstuff::MsgReqCmdBatch;
+using hotstuff::MsgRespCmdBatch;
+using hotstuff::Finality;
 using hotstuff::CommandDummy;
 using hotstuff::HotStuffError;
 using hotstuff::uint256_t;
 using hotstuff::opcode_t;
 using hotstuff::command_t;
+using hotstuff::get_mono_time;
+using std::placeholders::_1;
+using std::placeholders::_2;
 
-EventContext ec;
-ReplicaID proposer;
-size_t max_async_num;
-int max_iter_num;
-uint32_t cid;
-uint32_t cnt = 0;
+using Net = salticidae::MsgNetwork<opcode_t>;
+
+std::vector<NetAddr> replicas;
 uint32_t nfaulty;
+bool poisson;
+
+/* Results of all workers, which update it with relaxed atomic operations
+ * only (no locking on the request path). */
+struct StatsAggregator {
+    static constexpr size_t max_nsec = 86400;
+    double t_start;
+    /* wall-clock time of t_start, to line up reports of several clients */
+    double t_start_unix;
+    hotstuff::AtomicLatencyHistogram lat_hist;
+    /* number of commands confirmed in each second since the start */
+    std::vector<std::atomic<uint64_t>> nconfirmed;
+    std::atomic<size_t> nsec;
+    /* requests still unconfirmed at exit */
+    std::atomic<uint64_t> noutstanding;
+
+    StatsAggregator():
+        t_start(get_mono_time()),
+        t_start_unix(std::chrono::duration<double>(
+            std::chrono::system_clock::now().time_since_epoch()).count()),
+        nconfirmed(max_nsec), nsec(0), noutstanding(0) {}
+
+    /* an unconfirmed request counts with its age, so that the slowest
+     * requests are not left out of the tail */
+    void on_outstanding(double t_intended) {
+        lat_hist.record((uint64_t)((get_mono_time() - t_intended) * 1e6));
+        noutstanding.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void on_confirm(double t_intended) {
+        double now = get_mono_time();
+        lat_hist.record((uint64_t)((now - t_intended) * 1e6));
+        size_t sec = std::min((size_t)(now - t_start), max_nsec - 1);
+        nconfirmed[sec].fetch_add(1, std::memory_order_relaxed);
+        size_t n = nsec.load(std::memory_order_relaxed);
+        while (sec >= n && !nsec.compare_exchange_weak(
+                    n, sec + 1, std::memory_order_relaxed));
+    }
+
+    void print_report() const {
+        auto h = lat_hist.snapshot();
+        fprintf(stderr, "latency (us): count %lu, outstanding %lu, mean %.1f, max %lu\n",
+                h.get_count(), noutstanding.load(), h.get_mean(), h.get_max());
+        for (double p: {0.5, 0.75, 0.9, 0.99, 0.999, 0.9999, 1.0})
+            fprintf(stderr, "%9.4f%% %10lu\n", p * 100, h.get_percentile(p));
+        fprintf(stderr, "throughput (cmds/sec) since %.6f:\n", t_start_unix);
+        for (size_t i = 0; i < nsec.load(); i++)
+            fprintf(stderr, "%5lu %10lu\n", i, nconfirmed[i].load());
+    }
+};
 
 struct Request {
     command_t cmd;
     size_t confirmed;
+    /* when the request was meant to be sent; latency is measured from here
+     * so that a stalled client does not hide queueing delay */
+    double t_intended;
     salticidae::ElapsedTime et;
-    Request(const command_t &cmd): cmd(cmd), confirmed(0) { et.start(); }
+    Request(const command_t &cmd, double t_intended):
+        cmd(cmd), confirmed(0), t_intended(t_intended) { et.start(); }
 };
 
-using Net = salticidae::MsgNetwork<opcode_t>;
-
-std::unordered_map<ReplicaID, Net::conn_t> conns;
-std::unordered_map<const uint256_t, Request> waiting;
-std::vector<NetAddr> replicas;
-std::vector<std::pair<struct timeval, double>> elapsed;
-Net mn(ec, Net::Config());
+/** A load generator with its own event loop, connections and request
+ * window, run on a thread of its own. */
+class ClientWorker {
+    EventContext ec;
+    Net mn;
+    salticidae::ThreadCall tcall;
+    StatsAggregator &stats;
+    uint32_t cid;
+    uint32_t cnt;
+    size_t max_async_num;
+    int max_iter_num;
+    /* commands sent in one message at most */
+    size_t batch_size;
+    /* commands not sent yet */
+    std::vector<command_t> outgoing;
+    /* open loop: target request rate (0 for closed loop) */
+    double rate;
+    /* delay of the first request, so that workers are interleaved */
+    double start_offset;
+    /* the time the next request is due */
+    double next_arrival;
+    std::mt19937_64 rng;
+    salticidae::TimerEvent send_timer;
+    std::unordered_map<ReplicaID, Net::conn_t> conns;
+    std::unordered_map<const uint256_t, Request> waiting;
+    std::thread handle;
 
-void connect_all() {
-    for (size_t i = 0; i < replicas.size(); i++){
-        conns.insert(std::make_pair(i, mn.connect_sync(replicas[i])));
+    void connect_all() {
+        for (size_t i = 0; i < replicas.size(); i++){
+            conns.insert(std::make_pair(i, mn.connect_sync(replicas[i])));
+        }
     }
-}
 
-bool try_send(bool check = true) {
-    if ((!check || waiting.size() < max_async_num) && max_iter_num)
-    {
-        auto cmd = new CommandDummy(cid, cnt++);
-        MsgReqCmd msg(*cmd);
-        for (auto &p: conns){
+    template<typename Msg>
+    void send_to_all(Msg &&msg) {
+        for (auto &p: conns)
             mn.send_msg(msg, p.second);
+    }
+
+    /* send the outgoing commands to every replica, in one message */
+    void flush_cmds() {
+        if (outgoing.empty()) return;
+        if (outgoing.size() == 1)
+            send_to_all(MsgReqCmd(*outgoing[0]));
+        else
+            send_to_all(MsgReqCmdBatch(outgoing));
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
-        HOTSTUFF_LOG_INFO("send new cmd %.10s, %d",
-                            get_hex(cmd->get_hash()).c_str(), p.second);
+        for (const auto &cmd: outgoing)
+            HOTSTUFF_LOG_INFO("send new cmd %.10s",
+                                get_hex(cmd->get_hash()).c_str());
 #endif
-        } 
-            
+        outgoing.clear();
+    }
 
+    void send_cmd(double t_intended) {
+        command_t cmd = new CommandDummy(cid, cnt++);
         waiting.insert(std::make_pair(
-            cmd->get_hash(), Request(cmd)));
+            cmd->get_hash(), Request(cmd, t_intended)));
+        outgoing.push_back(cmd);
+        if (outgoing.size() >= batch_size)
+            flush_cmds();
         if (max_iter_num > 0)
             max_iter_num--;
-        return true;
     }
-    return false;
-}
 
-void client_resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &) {
-    auto &fin = msg.fin;
-    HOTSTUFF_LOG_DEBUG("got %s", std::string(msg.fin).c_str());
-    const uint256_t &cmd_hash = fin.cmd_hash;
-    auto it = waiting.find(cmd_hash);
-    auto &et = it->second.et;
-    if (it == waiting.end()) return;
-    et.stop();
-    if (++it->second.confirmed <= nfaulty) return; // wait for f + 1 ack
+    bool try_send(bool check = true) {
+        if ((!check || waiting.size() < max_async_num) && max_iter_num)
+        {
+            send_cmd(get_mono_time());
+            return true;
+        }
+        return false;
+    }
+
+    double next_interarrival() {
+        if (poisson)
+            return std::exponential_distribution<double>(rate)(rng);
+        return 1 / rate;
+    }
+
+    /* open loop: send every request that is due, regardless of the outstanding
+     * ones (catching up after a stall instead of lowering the offered load) */
+    void on_send_timer() {
+        double now = get_mono_time();
+        while (max_iter_num && next_arrival <= now)
+        {
+            send_cmd(next_arrival);
+            next_arrival += next_interarrival();
+        }
+        flush_cmds();
+        if (max_iter_num)
+            send_timer.add(next_arrival - now);
+    }
+
+    void on_fin(const Finality &fin) {
+        HOTSTUFF_LOG_DEBUG("got %s", std::string(fin).c_str());
+        const uint256_t &cmd_hash = fin.cmd_hash;
+        auto it = waiting.find(cmd_hash);
+        if (it == waiting.end()) return;
+        auto &et = it->second.et;
+        et.stop();
+        if (++it->second.confirmed <= nfaulty) return; // wait for f + 1 ack
 #ifndef HOTSTUFF_ENABLE_BENCHMARK
-    HOTSTUFF_LOG_INFO("got %s, wall: %.3f, cpu: %.3f",
-                        std::string(fin).c_str(),
-                        et.elapsed_sec, et.cpu_elapsed_sec);
-#else
-    struct timeval tv;
-    gettimeofday(&tv, nullptr);
-    elapsed.push_back(std::make_pair(tv, et.elapsed_sec));
+        HOTSTUFF_LOG_INFO("got %s, wall: %.3f, cpu: %.3f",
+                            std::string(fin).c_str(),
+                            et.elapsed_sec, et.cpu_elapsed_sec);
 #endif
-    waiting.erase(it);
-    int a;
-        try_send();
+        stats.on_confirm(it->second.t_intended);
+        waiting.erase(it);
+        if (rate <= 0)
+            try_send();
+    }
 
-}
+    void client_resp_cmd_handler(MsgRespCmd &&msg, const Net::conn_t &) {
+        on_fin(msg.fin);
+        flush_cmds();
+    }
+
+    void client_resp_cmd_batch_handler(MsgRespCmdBatch &&msg, const Net::conn_t &) {
+        for (const auto &fin: msg.fins)
+            on_fin(fin);
+        flush_cmds();
+    }
+
+    void run() {
+        mn.start();
+        connect_all();
+        if (rate > 0)
+        {
+            next_arrival = get_mono_time() + start_offset;
+            on_send_timer();
+        }
+        else
+        {
+            try_send();
+            flush_cmds();
+        }
+        ec.dispatch();
+        for (const auto &p: waiting)
+            stats.on_outstanding(p.second.t_intended);
+    }
+
+    public:
+    ClientWorker(StatsAggregator &stats, uint32_t cid,
+                size_t max_async_num, int max_iter_num, size_t batch_size,
+                double rate, double start_offset):
+            mn(ec, Net::Config()), tcall(ec), stats(stats),
+            cid(cid), cnt(0),
+            max_async_num(max_async_num), max_iter_num(max_iter_num),
+            batch_size(batch_size),
+            rate(rate), start_offset(start_offset), next_arrival(0),
+            rng(std::random_device()()) {
+        mn.reg_handler(salticidae::generic_bind(
+            &ClientWorker::client_resp_cmd_handler, this, _1, _2));
+        mn.reg_handler(salticidae::generic_bind(
+            &ClientWorker::client_resp_cmd_batch_handler, this, _1, _2));
+        send_timer = salticidae::TimerEvent(ec, [this](salticidae::TimerEvent &) {
+            on_send_timer();
+        });
+    }
+
+    void start() { handle = std::thread([this]() { run(); }); }
+
+    void stop() {
+        tcall.async_call([this](salticidae::ThreadCall::Handle &) { ec.stop(); });
+        handle.join();
+    }
+};
 
 std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
     auto ret = salticidae::trim_all(salticidae::split(s, ";"));
@@ -131,25 +298,42 @@ int main(int argc, char **argv) {
     auto opt_max_iter_num = Config::OptValInt::create(100);
     auto opt_max_async_num = Config::OptValInt::create(10);
     auto opt_cid = Config::OptValInt::create(-1);
+    auto opt_rate = Config::OptValDouble::create(0);
+    auto opt_arrival = Config::OptValStr::create("poisson");
+    auto opt_nworker = Config::OptValInt::create(1);
+    auto opt_batch_size = Config::OptValInt::create(1);
 
+    EventContext ec;
     auto shutdown = [&](int) { ec.stop(); };
     salticidae::SigEvent ev_sigint(ec, shutdown);
     salticidae::SigEvent ev_sigterm(ec, shutdown);
     ev_sigint.add(SIGINT);
     ev_sigterm.add(SIGTERM);
 
-    mn.reg_handler(client_resp_cmd_handler);
-    mn.start();
-
     config.add_opt("idx", opt_idx, Config::SET_VAL);
     config.add_opt("cid", opt_cid, Config::SET_VAL);
     config.add_opt("replica", opt_replicas, Config::APPEND);
     config.add_opt("iter", opt_max_iter_num, Config::SET_VAL);
     config.add_opt("max-async", opt_max_async_num, Config::SET_VAL);
+    config.add_opt("rate", opt_rate, Config::SET_VAL);
+    config.add_opt("arrival", opt_arrival, Config::SET_VAL);
+    config.add_opt("nworker", opt_nworker, Config::SET_VAL);
+    config.add_opt("batch", opt_batch_size, Config::SET_VAL);
     config.parse(argc, argv);
     auto idx = opt_idx->get();
-    max_iter_num = opt_max_iter_num->get();
-    max_async_num = opt_max_async_num->get();
+    auto max_iter_num = opt_max_iter_num->get();
+    auto rate = opt_rate->get();
+    auto nworker = opt_nworker->get();
+    if (nworker < 1 || nworker > 0xffff)
+        throw std::invalid_argument("nworker must be in [1, 65535]");
+    if (opt_batch_size->get() < 1)
+        throw std::invalid_argument("batch must be positive");
+    if (opt_arrival->get() == "poisson")
+        poisson = true;
+    else if (opt_arrival->get() == "const")
+        poisson = false;
+    else
+        throw std::invalid_argument("arrival must be poisson or const");
     std::vector<std::string> raw;
     for (const auto &s: opt_replicas->get())
     {
@@ -161,7 +345,7 @@ int main(int argc, char **argv) {
 
     if (!(0 <= idx && (size_t)idx < raw.size() && raw.size() > 0))
         throw std::invalid_argument("out of range");
-    cid = opt_cid->get() != -1 ? opt_cid->get() : idx;
+    uint32_t cid = opt_cid->get() != -1 ? opt_cid->get() : idx;
     for (const auto &p: raw)
     {
         auto _p = split_ip_port_cport(p);
@@ -171,22 +355,27 @@ int main(int argc, char **argv) {
 
     nfaulty = (replicas.size() - 1) / 3;
     HOTSTUFF_LOG_INFO("nfaulty = %zu", nfaulty);
-    connect_all();
-
-    int a;
 
-        try_send();
+    /* each worker takes its share of the load, under a distinct client id
+     * (the worker index in the low 16 bits); with a constant rate, worker i
+     * starts i / rate later so that the merged arrivals stay evenly spaced */
+    StatsAggregator stats;
+    std::vector<std::unique_ptr<ClientWorker>> workers;
+    for (int i = 0; i < nworker; i++)
+    {
+        int niter = max_iter_num < 0 ? max_iter_num :
+                    max_iter_num / nworker + (i < max_iter_num % nworker);
+        workers.emplace_back(new ClientWorker(
+            stats, (cid << 16) | (uint32_t)i,
+            opt_max_async_num->get(), niter,
+            opt_batch_size->get(), rate / nworker,
+            rate > 0 ? i / rate : 0));
+    }
+    for (auto &w: workers) w->start();
 
     ec.dispatch();
 
-#ifdef HOTSTUFF_ENABLE_BENCHMARK
-    for (const auto &e: elapsed)
-    {
-        char fmt[64];
-        struct tm *tmp = localtime(&e.first.tv_sec);
-        strftime(fmt, sizeof fmt, "%Y-%m-%d %H:%M:%S.%%06u [hotstuff info] %%.6f\n", tmp);
-        fprintf(stderr, fmt, e.first.tv_usec, e.second);
-    }
-#endif
+    for (auto &w: workers) w->stop();
+    stats.print_report();
     return 0;
 }
@@ -50,6 +50,48 @@ struct MsgRespCmd {
     }
 };
 
+/** A batch of commands (the receiver parses the `ncmd` commands that remain
+ * in `serialized`). */
+struct MsgReqCmdBatch {
+    static const opcode_t opcode = 0xd;
+    DataStream serialized;
+    uint32_t ncmd;
+    MsgReqCmdBatch(const std::vector<command_t> &cmds) {
+        serialized << htole((uint32_t)cmds.size());
+        for (const auto &cmd: cmds) serialized << *cmd;
+    }
+    MsgReqCmdBatch(DataStream &&s): serialized(std::move(s)) {
+        serialized >> ncmd;
+        ncmd = letoh(ncmd);
+        /* a command takes at least its cid and n */
+        if (ncmd > serialized.size() / (2 * sizeof(uint32_t)))
+            throw std::invalid_argument("ill-formed command batch");
+    }
+};
+
+/** The decisions of a committed block for one client connection. */
+struct MsgRespCmdBatch {
+    static const opcode_t opcode = 0xe;
+    DataStream serialized;
+    std::vector<Finality> fins;
+    MsgRespCmdBatch(const std::vector<Finality> &fins) {
+        serialized << htole((uint32_t)fins.size());
+        for (const auto &fin: fins) serialized << fin;
+    }
+    MsgRespCmdBatch(DataStream &&s) {
+        /* the shortest encoding of a Finality (a rejected command) */
+        static const size_t min_fin_size =
+            sizeof(ReplicaID) + sizeof(int8_t) + 2 * sizeof(uint32_t) + 32;
+        uint32_t n;
+        s >> n;
+        n = letoh(n);
+        if (n > s.size() / min_fin_size)
+            throw std::invalid_argument("ill-formed finality batch");
+        fins.resize(n);
+        for (auto &fin: fins) s >> fin;
+    }
+};
+
 //#ifdef HOTSTUFF_AUTOCLI
 //struct MsgDemandCmd {
 //    static const opcode_t opcode = 0x6;
@@ -33,6 +33,18 @@ struct Proposal;
 struct Vote;
 struct Finality;
 
+/** Orders delivered blocks by height (highest first), then by address. */
+struct BlockHeightOrder {
+    bool operator()(const block_t &a, const block_t &b) const {
+        if (a->get_height() != b->get_height())
+            return a->get_height() > b->get_height();
+        return a.get() < b.get();
+    }
+};
+
+/** Tail blocks, the highest first. */
+using tail_set_t = std::set<block_t, BlockHeightOrder>;
+
 /** Abstraction for HotStuff protocol state machine (without network implementation). */
 class HotStuffCore {
     block_t b0;                                  /** the genesis block */
@@ -44,7 +56,8 @@ class HotStuffCore {
     uint32_t vheight;          /**< height of the block last voted for */
     /* === auxilliary variables === */
     privkey_bt priv_key;            /**< private key for signing votes */
-    std::set<block_t> tails;   /**< set of tail blocks */
+    tail_set_t tails;          /**< set of tail blocks */
+    mutable size_t max_ntails; /**< most tails seen since the last reset */
     ReplicaConfig config;                   /**< replica configuration */
     /* === async event queues === */
     std::unordered_map<block_t, promise_t> qc_waiting;
@@ -54,6 +67,9 @@ class HotStuffCore {
     /* == feature switches == */
     /** always vote negatively, useful for some PaceMakers */
     bool vote_disabled;
+    /** pass the proposer's own vote to do_vote() instead of keeping it,
+     * for PaceMakers where another replica collects the votes */
+    bool self_vote_forwarded;
 
     block_t get_delivered_blk(const uint256_t &blk_hash);
     void sanity_check_delivered(const block_t &blk);
@@ -73,7 +89,8 @@ class HotStuffCore {
     int listen_port_for_iri;
     int send_port_for_iri;
     Coo *coo;
-    bool check_cmds(std::vector<uint256_t> cmds);
+    /** Ask the IRI whether the commands (a milestone) are legal. */
+    virtual bool check_cmds(std::vector<uint256_t> cmds);
     BoxObj<EntityStorage> storage;
     std::unordered_map<const uint256_t, uint32_t> decision_waiting_with_none_client;
     HotStuffCore(ReplicaID id, privkey_bt &&priv_key);
@@ -113,6 +130,16 @@ class HotStuffCore {
                     const std::vector<block_t> &parents,
                     bytearray_t &&extra = bytearray_t());
 
+    /** Call to have the chain ending at `blk`, which should have got its QC,
+     * make progress (e.g., commit) without proposing another block: the QC
+     * is applied locally and sent to the other replicas. */
+    void flush_qc(const block_t &blk);
+
+    /** Call upon the delivery of a QC sent by `flush_qc`, which has the same
+     * effect as a block carrying it. `blk` should be already delivered and
+     * `qc` verified. */
+    void on_receive_flush_qc(const block_t &blk, quorum_cert_bt &&qc);
+
     /* Functions required to construct concrete instances for abstract classes.
      * */
 
@@ -124,10 +151,16 @@ class HotStuffCore {
     /** Called by HotStuffCore upon the decision being made for cmd. */
     virtual void do_decide(Finality &&fin) = 0;
     virtual void do_consensus(const block_t &blk) = 0;
+    /** Called by HotStuffCore after do_decide() for all commands of a
+     * committed block, e.g. to flush the decisions to the clients. */
+    virtual void do_decide_blk(const block_t &) {}
     /** Called by HotStuffCore upon broadcasting a new proposal.
      * The user should send the proposal message to all replicas except for
      * itself. */
     virtual void do_broadcast_proposal(const Proposal &prop) = 0;
+    /** Called by HotStuffCore upon flushing the QC for a block. The user
+     * should send it to all replicas except for itself. */
+    virtual void do_broadcast_flush_qc(const uint256_t &blk_hash, const QuorumCert &qc) = 0;
     /** Called upon sending out a new vote to the next proposer.  The user
      * should send the vote message to a *good* proposer to have good liveness,
      * while safety is always guaranteed by HotStuffCore. */
@@ -138,6 +171,13 @@ class HotStuffCore {
     public:
     /** Create a partial certificate that proves the vote for a block. */
     virtual part_cert_bt create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) = 0;
+    /** Create a partial certificate off the event loop. The returned promise
+     * is resolved with a `PartCert *` owned by the receiver (nullptr on
+     * failure). */
+    virtual promise_t async_create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) {
+        PartCert *pc = create_part_cert(priv_key, blk_hash).unwrap();
+        return promise_t([pc](promise_t &pm) { pm.resolve(pc); });
+    }
     /** Create a partial certificate from its seralized form. */
     virtual part_cert_bt parse_part_cert(DataStream &s) = 0;
     /** Create a quorum certificate that proves 2f+1 votes for a block. */
@@ -170,9 +210,19 @@ class HotStuffCore {
     const block_t &get_hqc() { return hqc.first; }
     const ReplicaConfig &get_config() const { return config; }
     ReplicaID get_id() const { return id; }
-    const std::set<block_t> get_tails() const { return tails; }
+    const tail_set_t &get_tails() const { return tails; }
+    /** The highest tail block. */
+    const block_t &get_highest_tail() const { return *tails.begin(); }
+    /** Get the largest number of tails (concurrent forks) seen since the
+     * last call. */
+    size_t reset_max_ntails() const {
+        size_t ret = max_ntails;
+        max_ntails = tails.size();
+        return ret;
+    }
     operator std::string () const;
     void set_vote_disabled(bool f) { vote_disabled = f; }
+    void set_self_vote_forwarded(bool f) { self_vote_forwarded = f; }
 };
 
 /** Abstraction for proposal messages. */
@@ -199,9 +249,9 @@ struct Proposal: public Serializable {
     void unserialize(DataStream &s) override {
         assert(hsc != nullptr);
         s >> proposer;
-        Block _blk;
-        _blk.unserialize(s, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+        block_t _blk = new Block();
+        _blk->unserialize(s, hsc);
+        blk = hsc->storage->add_blk(_blk);
     }
 
     operator std::string () const {
@@ -17,6 +17,8 @@
 #ifndef _HOTSTUFF_CRYPTO_H
 #define _HOTSTUFF_CRYPTO_H
 
+#include <array>
+#include <vector>
 #include <openssl/rand.h>
 
 #include "secp256k1.h"
@@ -99,6 +101,12 @@ class PartCertDummy: public PartCert {
         return promise_t([](promise_t &pm){ pm.resolve(true); });
     }
 
+    static promise_t create_async(const PrivKey &, const uint256_t &obj_hash, VeriPool &) {
+        return promise_t([obj_hash](promise_t &pm) {
+            pm.resolve(static_cast<PartCert *>(new PartCertDummy(obj_hash)));
+        });
+    }
+
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 };
 
@@ -109,6 +117,8 @@ class Secp256k1Context {
     secp256k1_context *ctx;
     friend class PubKeySecp256k1;
     friend class SigSecp256k1;
+    friend class QuorumCertSecp256k1;
+    friend class Secp256k1VeriTask;
     public:
     Secp256k1Context(bool sign = false):
         ctx(secp256k1_context_create(
@@ -136,6 +146,8 @@ class PrivKeySecp256k1;
 class PubKeySecp256k1: public PubKey {
     static const auto _olen = 33;
     friend class SigSecp256k1;
+    friend class QuorumCertSecp256k1;
+    friend class Secp256k1VeriTask;
     secp256k1_pubkey data;
     secp256k1_context_t ctx;
 
@@ -300,7 +312,6 @@ class SigSecp256k1: public Serializable {
 };
 class QuorumCert: public Serializable, public Cloneable {
     public:
-    std::unordered_map<ReplicaID, SigSecp256k1> sigs;
     virtual ~QuorumCert() = default;
     virtual void add_part(ReplicaID replica, const PartCert &pc) = 0;
     virtual void compute() = 0;
@@ -308,6 +319,10 @@ class QuorumCert: public Serializable, public Cloneable {
     virtual bool verify(const ReplicaConfig &config) = 0;
     virtual const salticidae::Bits &get_rids() const = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
+    /** Write the DER form of the part signed by `rid` into `ser` (of
+     * capacity `len`), used when exporting the QC to the coordinator.
+     * @return false if there is no such part. */
+    virtual bool get_part_der(ReplicaID rid, uint8_t *ser, size_t &len) const = 0;
     virtual QuorumCert *clone() override = 0;
 };
 using quorum_cert_bt = BoxObj<QuorumCert>;
@@ -326,6 +341,8 @@ class QuorumCertDummy: public QuorumCert {
     void unserialize(DataStream &s) override {
         uint32_t tmp;
         s >> tmp >> obj_hash;
+        if (tmp != 1)
+            throw std::invalid_argument("ill-formed dummy QC");
     }
 
     QuorumCert *clone() override {
@@ -340,32 +357,56 @@ class QuorumCertDummy: public QuorumCert {
     }
     const salticidae::Bits &get_rids() const override { return rids; }
     const uint256_t &get_obj_hash() const override { return obj_hash; }
+    bool get_part_der(ReplicaID, uint8_t *, size_t &) const override { return false; }
 };
+/** The serialized bytes of a uint256_t, i.e. the message secp256k1 signs,
+ * kept inline so that verification does not touch the heap. */
+using digest_t = std::array<uint8_t, 32>;
+
+inline digest_t to_digest(const uint256_t &h) {
+    const bytearray_t b = h.to_bytes();
+    digest_t d;
+    std::copy(b.begin(), b.end(), d.begin());
+    return d;
+}
+
+/** Read a uint256_t off the stream, keeping its wire bytes as the digest. */
+inline void read_digest(DataStream &s, uint256_t &h, digest_t &d) {
+    auto base = s.get_data_inplace(d.size());
+    memmove(d.data(), base, d.size());
+    h.load(base);
+}
+
 class Secp256k1VeriTask: public VeriTask {
-    uint256_t msg;
-    PubKeySecp256k1 pubkey;
-    SigSecp256k1 sig;
+    digest_t msg;
+    /** the key is held by ReplicaConfig, which outlives the task */
+    const PubKeySecp256k1 &pubkey;
+    secp256k1_ecdsa_signature sig;
     public:
-    Secp256k1VeriTask(const uint256_t &msg,
+    Secp256k1VeriTask(const digest_t &msg,
                         const PubKeySecp256k1 &pubkey,
-                        const SigSecp256k1 &sig):
+                        const secp256k1_ecdsa_signature &sig):
         msg(msg), pubkey(pubkey), sig(sig) {}
     virtual ~Secp256k1VeriTask() = default;
 
     bool verify() override {
-        return sig.verify(msg, pubkey, secp256k1_default_verify_ctx);
+        return secp256k1_ecdsa_verify(
+                secp256k1_default_verify_ctx->ctx, &sig,
+                msg.data(), &pubkey.data) == 1;
     }
 };
 
 class PartCertSecp256k1: public SigSecp256k1, public PartCert {
+    friend class Secp256k1SignTask;
     uint256_t obj_hash;
+    digest_t digest;
 
     public:
     PartCertSecp256k1() = default;
     PartCertSecp256k1(const PrivKeySecp256k1 &priv_key, const uint256_t &obj_hash):
         SigSecp256k1(obj_hash, priv_key),
         PartCert(),
-        obj_hash(obj_hash) {}
+        obj_hash(obj_hash), digest(to_digest(obj_hash)) {}
 
     bool verify(const PubKey &pub_key) override {
         return SigSecp256k1::verify(obj_hash,
@@ -374,13 +415,18 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
     }
 
     promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
-        return vpool.verify(new Secp256k1VeriTask(obj_hash,
-                static_cast<const PubKeySecp256k1 &>(pub_key),
-                static_cast<const SigSecp256k1 &>(*this)));
+        return vpool.verify<Secp256k1VeriTask>(digest,
+                static_cast<const PubKeySecp256k1 &>(pub_key), data);
     }
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 
+    /** Sign on a VeriPool worker. The returned promise is resolved with the
+     * new `PartCert *` (owned by the receiver), or nullptr on failure. */
+    static inline promise_t create_async(const PrivKeySecp256k1 &priv_key,
+                                        const uint256_t &obj_hash,
+                                        VeriPool &vpool);
+
     PartCertSecp256k1 *clone() override {
         return new PartCertSecp256k1(*this);
     }
@@ -391,24 +437,96 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
     }
 
     void unserialize(DataStream &s) override {
-        s >> obj_hash;
+        static const auto _exc = std::invalid_argument("ill-formed partial certificate");
+        try {
+            read_digest(s, obj_hash, digest);
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
         this->SigSecp256k1::unserialize(s);
     }
 };
 
+class Secp256k1SignTask: public VeriTask {
+    /** handed over to the promise receiver in finish() */
+    PartCertSecp256k1 *cert;
+    /** the key is held by HotStuffCore, which outlives the task */
+    const PrivKeySecp256k1 &priv_key;
+    public:
+    Secp256k1SignTask(PartCertSecp256k1 *cert,
+                        const PrivKeySecp256k1 &priv_key):
+        cert(cert), priv_key(priv_key) {}
+    virtual ~Secp256k1SignTask() = default;
+
+    bool verify() override {
+        try {
+            cert->sign(cert->obj_hash, priv_key);
+        } catch (std::invalid_argument &) {
+            return false;
+        }
+        return true;
+    }
+
+    void finish(promise_t &pm, bool result) override {
+        if (!result)
+        {
+            delete cert;
+            cert = nullptr;
+        }
+        pm.resolve(static_cast<PartCert *>(cert));
+    }
+};
+
+promise_t PartCertSecp256k1::create_async(const PrivKeySecp256k1 &priv_key,
+                                        const uint256_t &obj_hash,
+                                        VeriPool &vpool) {
+    auto cert = new PartCertSecp256k1();
+    cert->obj_hash = obj_hash;
+    cert->digest = to_digest(obj_hash);
+    return vpool.verify<Secp256k1SignTask>(cert, priv_key);
+}
+
 class QuorumCertSecp256k1: public QuorumCert {
+    /** raw 64-byte compact signature */
+    using compact_sig_t = std::array<uint8_t, 64>;
+    static_assert(sizeof(compact_sig_t) == 64, "compact signature should be 64 bytes");
+
     uint256_t obj_hash;
+    digest_t digest;
     salticidae::Bits rids;
+    /** signatures indexed by replica id (only valid where `rids` is set), so
+     * that the certificate is one flat chunk of memory sharing the default
+     * context */
+    std::vector<compact_sig_t> sigs;
+
+    static secp256k1_context *get_ctx() {
+        return secp256k1_default_verify_ctx->ctx;
+    }
+
+    size_t get_nparts() const {
+        size_t cnt = 0;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) cnt++;
+        return cnt;
+    }
+
+    bool parse_part(ReplicaID rid, secp256k1_ecdsa_signature &sig) const {
+        return secp256k1_ecdsa_signature_parse_compact(
+                get_ctx(), &sig, sigs[rid].data());
+    }
+
     public:
-    
     QuorumCertSecp256k1() = default;
     QuorumCertSecp256k1(const ReplicaConfig &config, const uint256_t &obj_hash);
 
     void add_part(ReplicaID rid, const PartCert &pc) override {
         if (pc.get_obj_hash() != obj_hash)
             throw std::invalid_argument("PartCert does match the block hash");
-        sigs.insert(std::make_pair(
-            rid, static_cast<const PartCertSecp256k1 &>(pc)));
+        if (rid >= sigs.size())
+            throw std::invalid_argument("replica id out of range");
+        (void)secp256k1_ecdsa_signature_serialize_compact(
+            get_ctx(), sigs[rid].data(),
+            &static_cast<const PartCertSecp256k1 &>(pc).data);
         rids.set(rid);
     }
 
@@ -420,6 +538,13 @@ class QuorumCertSecp256k1: public QuorumCert {
     const uint256_t &get_obj_hash() const override { return obj_hash; }
     const salticidae::Bits &get_rids() const override { return rids; }
 
+    bool get_part_der(ReplicaID rid, uint8_t *ser, size_t &len) const override {
+        secp256k1_ecdsa_signature sig;
+        if (rid >= sigs.size() || !rids.get(rid) || !parse_part(rid, sig))
+            return false;
+        return secp256k1_ecdsa_signature_serialize_der(get_ctx(), ser, &len, &sig);
+    }
+
     QuorumCertSecp256k1 *clone() override {
         return new QuorumCertSecp256k1(*this);
     }
@@ -427,13 +552,38 @@ class QuorumCertSecp256k1: public QuorumCert {
     void serialize(DataStream &s) const override {
         s << obj_hash << rids;
         for (size_t i = 0; i < rids.size(); i++)
-            if (rids.get(i)) s << sigs.at(i);
+            if (rids.get(i)) s.put_data(sigs[i].begin(), sigs[i].end());
     }
 
     void unserialize(DataStream &s) override {
-        s >> obj_hash >> rids;
-        for (size_t i = 0; i < rids.size(); i++)
-            if (rids.get(i)) s >> sigs[i];
+        static const auto _exc = std::invalid_argument("ill-formed signature");
+        try {
+            read_digest(s, obj_hash, digest);
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+        /* the signature slots are sized by the replica config (see the
+         * constructor); check the untrusted bit count (a leading uint32)
+         * before Bits allocates for it */
+        uint32_t nbits;
+        if (s.size() < sizeof(nbits)) throw _exc;
+        memmove(&nbits, s.data(), sizeof(nbits));
+        if (letoh(nbits) != sigs.size())
+            throw std::invalid_argument("QC does not match the replica set");
+        try {
+            s >> rids;
+            for (size_t i = 0; i < rids.size(); i++)
+                if (rids.get(i))
+                {
+                    secp256k1_ecdsa_signature sig;
+                    auto base = s.get_data_inplace(64);
+                    if (!secp256k1_ecdsa_signature_parse_compact(get_ctx(), &sig, base))
+                        throw _exc;
+                    memmove(sigs[i].data(), base, 64);
+                }
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
     }
 };
 
@@ -118,6 +118,7 @@ get_hashes(const std::vector<Hashable> &plist) {
 
 class Block {
     friend HotStuffCore;
+    friend class ChainSegment;
     std::vector<uint256_t> parent_hashes;
     std::vector<uint256_t> cmds;
     quorum_cert_bt qc;
@@ -221,6 +222,19 @@ struct BlockHeightCmp {
     }
 };
 
+/** Compact encoding of a sequence of blocks (a chain segment, ancestors
+ * first): parent hashes naming an earlier block of the sequence and QCs
+ * repeating an earlier one become back-references, and counts/lengths are
+ * varints. Signer sets are not delta-encoded: a QC can only be rebuilt
+ * through its own unserialize(), and the signatures, which dominate its
+ * size, differ for every certified block anyway. */
+class ChainSegment {
+    public:
+    static void serialize(DataStream &s, const std::vector<block_t> &blks);
+    /** Parse the blocks (not yet added to the storage). */
+    static std::vector<block_t> unserialize(DataStream &s, HotStuffCore *hsc);
+};
+
 class EntityStorage {
     std::unordered_map<const uint256_t, block_t> blk_cache;
     std::unordered_map<const uint256_t, command_t> cmd_cache;
@@ -235,16 +249,6 @@ class EntityStorage {
         return blk_cache.count(blk_hash);
     }
 
-    block_t add_blk(Block &&_blk, const ReplicaConfig &/*config*/) {
-        //if (!_blk.verify(config))
-        //{
-        //    HOTSTUFF_LOG_WARN("invalid %s", std::string(_blk).c_str());
-        //    return nullptr;
-        //}
-        block_t blk = new Block(std::move(_blk));
-        return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
-    }
-
     const block_t &add_blk(const block_t &blk) {
         return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
     }
@@ -0,0 +1,49 @@
+#ifndef _HOTSTUFF_ERASURE_H
+#define _HOTSTUFF_ERASURE_H
+
+#include <vector>
+#include <utility>
+
+#include "hotstuff/type.h"
+
+namespace hotstuff {
+
+/** Reed-Solomon code over GF(2^8): `n` chunks are produced from the payload
+ * (Vandermonde evaluation at points 0 ... n - 1), any `k` of which recover
+ * it. */
+class ReedSolomon {
+    size_t k;
+    size_t n;
+
+    public:
+    ReedSolomon(size_t k, size_t n);
+
+    /** Split `data` into `n` chunks of equal size. */
+    std::vector<bytearray_t> encode(const bytearray_t &data) const;
+    /** Recover the payload from at least `k` (index, chunk) pairs.
+     * @throw std::invalid_argument on malformed input. */
+    bytearray_t decode(const std::vector<std::pair<size_t, bytearray_t>> &chunks) const;
+};
+
+/** Merkle tree over chunks; an odd node at the end of a level is promoted
+ * unchanged. */
+class MerkleTree {
+    /** levels[0] holds the leaf hashes, the last level holds the root */
+    std::vector<std::vector<uint256_t>> levels;
+
+    public:
+    MerkleTree(const std::vector<bytearray_t> &leaves);
+
+    const uint256_t &get_root() const { return levels.back()[0]; }
+    /** Sibling hashes from the leaf up to the root. */
+    std::vector<uint256_t> get_proof(size_t idx) const;
+
+    static uint256_t hash_leaf(const bytearray_t &leaf);
+    static bool verify(const uint256_t &root, size_t idx, size_t nleaves,
+                    const bytearray_t &leaf,
+                    const std::vector<uint256_t> &proof);
+};
+
+}
+
+#endif
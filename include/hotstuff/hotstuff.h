@@ -19,6 +19,7 @@
 #define _HOTSTUFF_CORE_H
 
 #include <queue>
+#include <algorithm>
 #include <unordered_map>
 #include <pthread.h>
 #include <unordered_set>
@@ -27,6 +28,7 @@
 #include "salticidae/msg.h"
 #include "hotstuff/util.h"
 #include "hotstuff/consensus.h"
+#include "hotstuff/erasure.h"
 
 namespace hotstuff {
 
@@ -36,6 +38,9 @@ using salticidae::_1;
 using salticidae::_2;
 
 const double ent_waiting_timeout = 10;
+/** fetch timeout used before any RTT sample of the peer */
+const double ent_initial_timeout = 1;
+const double ent_min_timeout = 0.2;
 const double double_inf = 1e10;
 /** Network message format for HotStuff. */
 struct MsgPropose {
@@ -77,6 +82,82 @@ struct MsgRespBlock {
     void postponed_parse(HotStuffCore *hsc);
 };
 
+/** Liveness beacon sent periodically by the current proposer. */
+struct MsgHeartbeat {
+    static const opcode_t opcode = 0xc;
+    DataStream serialized;
+    ReplicaID rid;
+    MsgHeartbeat(ReplicaID rid);
+    MsgHeartbeat(DataStream &&s);
+};
+
+/** QC for a block, flushed instead of proposing an empty block to carry it. */
+struct MsgFlushQC {
+    static const opcode_t opcode = 0xb;
+    DataStream serialized;
+    uint256_t blk_hash;
+    quorum_cert_bt qc;
+    MsgFlushQC(const uint256_t &blk_hash, const QuorumCert &qc);
+    MsgFlushQC(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Response carrying several blocks as a compact chain segment (see
+ * ChainSegment). */
+struct MsgRespBlockSeg {
+    static const opcode_t opcode = 0xa;
+    DataStream serialized;
+    std::vector<block_t> blks;
+    MsgRespBlockSeg(const std::vector<block_t> &blks);
+    MsgRespBlockSeg(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Request for a block together with up to `nancestors` of its ancestors
+ * (following the first parent) above `min_height`. */
+struct MsgReqBlockRange {
+    static const opcode_t opcode = 0x9;
+    DataStream serialized;
+    uint256_t blk_hash;
+    uint32_t nancestors;
+    uint32_t min_height;
+    MsgReqBlockRange(const uint256_t &blk_hash,
+                    uint32_t nancestors, uint32_t min_height);
+    MsgReqBlockRange(DataStream &&s);
+};
+
+/** Votes for a block pre-aggregated along the dissemination tree rooted at
+ * `root` (the replica collecting the votes). */
+struct MsgTreeVote {
+    static const opcode_t opcode = 0x7;
+    DataStream serialized;
+    ReplicaID root;
+    uint256_t blk_hash;
+    std::vector<Vote> votes;
+    MsgTreeVote(ReplicaID root, const uint256_t &blk_hash,
+                const std::vector<Vote> &votes);
+    MsgTreeVote(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** One erasure-coded chunk of a serialized MsgPropose, with the Merkle proof
+ * against the root over all `nchunks` chunks. */
+struct MsgPropChunk {
+    static const opcode_t opcode = 0x8;
+    DataStream serialized;
+    ReplicaID proposer;
+    uint256_t root;
+    uint32_t nchunks;
+    uint32_t idx;
+    bytearray_t chunk;
+    std::vector<uint256_t> proof;
+    MsgPropChunk(ReplicaID proposer, const uint256_t &root,
+                uint32_t nchunks, uint32_t idx,
+                const bytearray_t &chunk,
+                const std::vector<uint256_t> &proof);
+    MsgPropChunk(DataStream &&s);
+};
+
 using promise::promise_t;
 
 class HotStuffBase;
@@ -85,11 +166,20 @@ using pacemaker_bt = BoxObj<class PaceMaker>;
 template<EntityType ent_type>
 class FetchContext: public promise_t {
     TimerEvent timeout;
+    /** fires a hedged request to the next replica that has the entity */
+    TimerEvent hedge_timer;
     HotStuffBase *hs;
-    MsgReqBlock fetch_msg;
     const uint256_t ent_hash;
-    std::unordered_set<NetAddr> replica_ids;
+    /** replicas known to have the entity, in the order they were learnt */
+    std::vector<NetAddr> replica_ids;
+    /** when the request to each replica was (first) sent */
+    std::unordered_map<NetAddr, double> sent_time;
+    /** current timeout, doubled on each expiry */
+    double rto;
+    /** no RTT samples from retransmitted requests (Karn's algorithm) */
+    bool retransmitted;
     inline void timeout_cb(TimerEvent &);
+    inline void hedge_cb(TimerEvent &);
     public:
     FetchContext(const FetchContext &) = delete;
     FetchContext &operator=(const FetchContext &) = delete;
@@ -101,6 +191,11 @@ class FetchContext: public promise_t {
     inline void send(const NetAddr &replica_id);
     inline void reset_timeout();
     inline void add_replica(const NetAddr &replica_id, bool fetch_now = true);
+    /** Record a request for the entity sent to `replica_id` (possibly by
+     * other means, e.g., a range request), starting the timers. */
+    inline void note_sent(const NetAddr &replica_id);
+    /** Called when the entity arrives from `replica_id`. */
+    inline void on_response(const NetAddr &replica_id);
 };
 
 class BlockDeliveryContext: public promise_t {
@@ -119,6 +214,27 @@ class BlockDeliveryContext: public promise_t {
     }
 };
 
+/** Remembers the digests of recently received messages so that exact
+ * duplicates can be dropped before they are parsed. Keys are kept for at
+ * least `gen_size` and at most 2 * `gen_size` insertions (two generations). */
+class MsgDupFilter {
+    size_t gen_size;
+    std::unordered_set<uint256_t> cur;
+    std::unordered_set<uint256_t> prev;
+    public:
+    MsgDupFilter(size_t gen_size): gen_size(gen_size) {}
+    /** Return true if `key` was seen recently, otherwise remember it. */
+    bool check(const uint256_t &key) {
+        if (cur.count(key) || prev.count(key)) return true;
+        if (cur.size() >= gen_size)
+        {
+            prev.swap(cur);
+            cur.clear();
+        }
+        cur.insert(key);
+        return false;
+    }
+};
 
 /** HotStuff protocol (with network implementation). */
 class HotStuffBase: public HotStuffCore {
@@ -160,6 +276,94 @@ class HotStuffBase: public HotStuffCore {
     std::unordered_map<const uint256_t, BlockFetchContext> blk_fetch_waiting;
     std::unordered_map<const uint256_t, BlockDeliveryContext> blk_delivery_waiting;
     std::unordered_map<const uint256_t, commit_cb_t> decision_waiting;
+
+    /* tree overlay (disabled when tree_fanout is 0): a replica at position p
+     * relative to the proposer forwards proposals to positions
+     * p * fanout + 1 ... p * fanout + fanout, and collects their votes */
+    struct TreeVoteAgg {
+        ReplicaID root;
+        std::vector<Vote> votes;
+        /** number of replicas in the subtree (including itself) */
+        size_t expected;
+        bool flushed;
+        TimerEvent timer;
+    };
+    static constexpr size_t tree_history_size = 256;
+    size_t tree_fanout;
+    double tree_agg_timeout;
+    std::unordered_map<uint256_t, TreeVoteAgg> tree_vote_agg;
+    /** blocks forwarded down the tree */
+    std::unordered_set<uint256_t> tree_relayed;
+    /** blocks re-sent by star broadcast, voted directly */
+    std::unordered_set<uint256_t> tree_star;
+    std::unordered_map<uint256_t, Vote> tree_my_votes;
+    /** all blocks tracked above, oldest first */
+    std::unordered_set<uint256_t> tree_seen;
+    std::queue<uint256_t> tree_history;
+
+    /* erasure-coded dissemination of proposals no smaller than ec_threshold
+     * bytes (disabled when 0) */
+    struct PropChunkSet {
+        ReplicaID proposer;
+        std::vector<std::pair<size_t, bytearray_t>> chunks;
+        std::vector<bool> have;
+        bool decoded;
+    };
+    static constexpr size_t ec_history_size = 64;
+    size_t ec_threshold;
+    /** chunks collected by Merkle root */
+    std::unordered_map<uint256_t, PropChunkSet> prop_chunks;
+    std::queue<uint256_t> ec_history;
+
+    /* block requests and responses are coalesced per peer and sent at the
+     * end of the flush window (the next event loop iteration by default) */
+    double blk_flush_window;
+    TimerEvent blk_flush_timer;
+    bool blk_flush_scheduled;
+    std::unordered_map<NetAddr, std::vector<uint256_t>> req_blk_pending;
+    std::unordered_map<NetAddr, std::vector<block_t>> resp_blk_pending;
+    /** number of ancestors requested along with a missing block (0 to fetch
+     * them one by one) */
+    uint32_t blk_range_limit;
+    static constexpr uint32_t max_blk_range = 1024;
+    /* bulk transfer (block responses) is queued per peer and drained under a
+     * token bucket of bulk_rate bytes/s (unlimited when 0) so that it does not
+     * crowd out consensus messages, which are always sent right away */
+    static constexpr double bulk_burst = 0.1;   /**< bucket size in seconds */
+    double bulk_rate;
+    double bulk_tokens;
+    double bulk_last_refill;
+    TimerEvent bulk_timer;
+    bool bulk_scheduled;
+    struct BulkMsg {
+        opcode_t opcode;
+        DataStream serialized;
+    };
+    std::unordered_map<NetAddr, std::queue<BulkMsg>> bulk_queue;
+    /** peers with queued bulk messages, in the order they are served next */
+    std::queue<NetAddr> bulk_ready;
+    size_t bulk_queued_msgs;
+    size_t bulk_queued_bytes;
+    mutable uint64_t part_bulk_sent;
+    mutable uint64_t part_bulk_deferred;
+    /** recently received proposals and votes */
+    static constexpr size_t dup_filter_size = 4096;
+    MsgDupFilter dup_filter;
+    /** Return true if the message was received recently (proposals are
+     * keyed by sender too, as the tree overlay tells copies apart by it). */
+    bool is_dup_msg(opcode_t opcode, const DataStream &s, const NetAddr *peer);
+    /** round-trip times of block requests, per peer */
+    std::unordered_map<NetAddr, RTTEstimator> peer_rtt;
+    /* the proposer sends heartbeats every hb_interval seconds (disabled when
+     * 0), and the others impeach it once their suspicion exceeds hb_phi */
+    double hb_interval;
+    double hb_phi;
+    TimerEvent hb_timer;
+    /** the proposer being watched */
+    ReplicaID hb_proposer;
+    PhiAccrualDetector hb_detector;
+    mutable uint32_t part_impeached;
+    void on_hb_timer();
     
     using cmd_queue_t = salticidae::MPSCQueueEventDriven<std::pair<uint256_t, commit_cb_t>>;
     cmd_queue_t cmd_pending;
@@ -176,6 +380,7 @@ class HotStuffBase: public HotStuffCore {
     mutable uint32_t part_delivered;
     mutable uint32_t part_decided;
     mutable uint32_t part_gened;
+    mutable uint32_t part_dup_dropped;
     mutable double part_delivery_time;
     mutable double part_delivery_time_min;
     mutable double part_delivery_time_max;
@@ -187,16 +392,58 @@ class HotStuffBase: public HotStuffCore {
 
     /** deliver consensus message: <propose> */
     inline void propose_handler(MsgPropose &&, const Net::conn_t &);
+    /** receives a chunk of a proposal */
+    inline void prop_chunk_handler(MsgPropChunk &&, const Net::conn_t &);
+    /** process a proposal sent (originally) by `peer` */
+    void process_proposal(MsgPropose &&msg, const NetAddr &peer);
+    void broadcast_proposal_chunks(const DataStream &serialized);
     /** deliver consensus message: <vote> */
     inline void vote_handler(MsgVote &&, const Net::conn_t &);
     /** fetches full block data */
     inline void req_blk_handler(MsgReqBlock &&, const Net::conn_t &);
+    /** fetches a block with its ancestors */
+    inline void req_blk_range_handler(MsgReqBlockRange &&, const Net::conn_t &);
     /** receives a block */
     inline void resp_blk_handler(MsgRespBlock &&, const Net::conn_t &);
+    inline void resp_blk_seg_handler(MsgRespBlockSeg &&, const Net::conn_t &);
+    void on_resp_blks(const std::vector<block_t> &blks, const NetAddr &peer);
+    /** deliver votes aggregated along the tree */
+    inline void tree_vote_handler(MsgTreeVote &&, const Net::conn_t &);
+    inline void flush_qc_handler(MsgFlushQC &&, const Net::conn_t &);
+    inline void heartbeat_handler(MsgHeartbeat &&, const Net::conn_t &);
+
+    /** The timeout for a request to `replica` (SRTT + 4 * RTTVAR). */
+    double get_fetch_timeout(const NetAddr &replica) const;
+    /** The delay before hedging a request to `replica` (p95 of its RTT). */
+    double get_hedge_delay(const NetAddr &replica) const;
+    void queue_req_blk(const uint256_t &blk_hash, const NetAddr &replica);
+    void queue_resp_blk(const block_t &blk, const NetAddr &replica);
+    void schedule_blk_flush();
+    void flush_blk_msgs();
+    void queue_bulk(opcode_t opcode, DataStream &&serialized, const NetAddr &replica);
+    void send_bulk(BulkMsg &&msg, const NetAddr &replica);
+    void drain_bulk();
+
+    /** verify a vote and pass it to the core */
+    void process_vote(Vote &&vote, const NetAddr &peer);
+
+    size_t tree_pos(ReplicaID root, ReplicaID rid) const {
+        return (rid + get_config().nreplicas - root) % get_config().nreplicas;
+    }
+    ReplicaID tree_rid(ReplicaID root, size_t pos) const {
+        return (root + pos) % get_config().nreplicas;
+    }
+    size_t tree_subtree_size(size_t pos) const;
+    std::vector<NetAddr> tree_children(ReplicaID root) const;
+    void tree_track(const uint256_t &blk_hash);
+    void tree_on_proposal(const Proposal &prop, const NetAddr &peer);
+    void tree_add_votes(ReplicaID root, const uint256_t &blk_hash, std::vector<Vote> &&votes);
+    void tree_flush_votes(const uint256_t &blk_hash);
 
     inline bool conn_handler(const salticidae::ConnPool::conn_t &, bool);
 
     void do_broadcast_proposal(const Proposal &) override;
+    void do_broadcast_flush_qc(const uint256_t &blk_hash, const QuorumCert &qc) override;
     void do_vote(ReplicaID, const Vote &) override;
     void do_decide(Finality &&) override;
     void do_consensus(const block_t &blk) override;
@@ -225,11 +472,47 @@ class HotStuffBase: public HotStuffCore {
     void exec_command(uint256_t cmd_hash, commit_cb_t callback);
     void start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas,
                 bool ec_loop = false);
+    /** Disseminate proposals and aggregate votes over a tree of the given
+     * fanout (0 for direct broadcast). An inner replica forwards the votes
+     * of its subtree once all of them arrive or `agg_timeout` expires. */
+    void set_tree_overlay(size_t fanout, double agg_timeout) {
+        tree_fanout = fanout;
+        tree_agg_timeout = agg_timeout;
+    }
+    /** Send proposals of at least `threshold` bytes as erasure-coded chunks
+     * (Reed-Solomon with k = f + 1), one per replica (0 to disable). The
+     * replicas echo their chunk to each other and decode the proposal from
+     * any k chunks. Only used without the tree overlay. */
+    void set_ec_threshold(size_t threshold) { ec_threshold = threshold; }
+    /** Set how long block requests and responses to the same peer are held
+     * to be sent together (0 for the next event loop iteration). */
+    void set_blk_flush_window(double window) { blk_flush_window = window; }
+    /** Set the number of missing ancestors requested together with a block
+     * (0 to fetch them one by one). */
+    void set_blk_range_limit(uint32_t limit) {
+        blk_range_limit = std::min(limit, max_blk_range);
+    }
+    /** Limit block transfer to `rate` bytes per second (0 for no limit). */
+    void set_bulk_rate(double rate) {
+        bulk_rate = rate;
+        bulk_tokens = rate * bulk_burst;
+    }
+    /** Detect the failure of the proposer by heartbeats sent every
+     * `interval` seconds, impeaching it at suspicion level `phi` (0 interval
+     * to disable, before `start`). */
+    void set_heartbeat(double interval, double phi) {
+        hb_interval = interval;
+        hb_phi = phi;
+    }
+    double get_hb_interval() const { return hb_interval; }
+    /** Send the proposal directly to all replicas, bypassing the tree. */
+    void broadcast_proposal_star(const Proposal &prop);
 
     size_t size() const { return peers.size(); }
     const auto &get_decision_waiting() const { return decision_waiting; }
     
     ThreadCall &get_tcall() { return tcall; }
+    VeriPool &get_vpool() { return vpool; }
     PaceMaker *get_pace_maker() { return pmaker.get(); }
     void print_stat() const;
     virtual void do_elected() {}
@@ -263,6 +546,12 @@ class HotStuff: public HotStuffBase {
                     blk_hash);
     }
 
+    promise_t async_create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) override {
+        return PartCertType::create_async(
+                    static_cast<const PrivKeyType &>(priv_key),
+                    blk_hash, vpool);
+    }
+
     part_cert_bt parse_part_cert(DataStream &s) override {
         PartCert *pc = new PartCertType();
         s >> *pc;
@@ -274,7 +563,7 @@ class HotStuff: public HotStuffBase {
     }
 
     quorum_cert_bt parse_quorum_cert(DataStream &s) override {
-        QuorumCert *qc = new QuorumCertType();
+        QuorumCert *qc = new QuorumCertType(get_config(), uint256_t());
         s >> *qc;
         return qc;
     }
@@ -318,61 +607,101 @@ template<EntityType ent_type>
 FetchContext<ent_type>::FetchContext(FetchContext && other):
         promise_t(static_cast<const promise_t &>(other)),
         hs(other.hs),
-        fetch_msg(std::move(other.fetch_msg)),
         ent_hash(other.ent_hash),
-        replica_ids(std::move(other.replica_ids)) {
+        replica_ids(std::move(other.replica_ids)),
+        sent_time(std::move(other.sent_time)),
+        rto(other.rto),
+        retransmitted(other.retransmitted) {
     other.timeout.del();
+    other.hedge_timer.del();
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
+    hedge_timer = TimerEvent(hs->ec,
+            std::bind(&FetchContext::hedge_cb, this, _1));
     reset_timeout();
 }
 
-template<>
-inline void FetchContext<ENT_TYPE_CMD>::timeout_cb(TimerEvent &) {
-    HOTSTUFF_LOG_WARN("cmd fetching %.10s timeout", get_hex(ent_hash).c_str());
+template<EntityType ent_type>
+void FetchContext<ent_type>::timeout_cb(TimerEvent &) {
+    HOTSTUFF_LOG_WARN("%s fetching %.10s timeout",
+                    ent_type == ENT_TYPE_BLK ? "block" : "cmd",
+                    get_hex(ent_hash).c_str());
+    retransmitted = true;
+    hedge_timer.del();
     for (const auto &replica_id: replica_ids)
         send(replica_id);
+    rto = std::min(rto * 2, ent_waiting_timeout);
     reset_timeout();
 }
 
-template<>
-inline void FetchContext<ENT_TYPE_BLK>::timeout_cb(TimerEvent &) {
-    HOTSTUFF_LOG_WARN("block fetching %.10s timeout", get_hex(ent_hash).c_str());
+template<EntityType ent_type>
+void FetchContext<ent_type>::hedge_cb(TimerEvent &) {
     for (const auto &replica_id: replica_ids)
-        send(replica_id);
-    reset_timeout();
+        if (!sent_time.count(replica_id))
+        {
+            HOTSTUFF_LOG_DEBUG("hedging the fetch of %.10s", get_hex(ent_hash).c_str());
+            send(replica_id);
+            return;
+        }
 }
 
 template<EntityType ent_type>
 FetchContext<ent_type>::FetchContext(
                                 const uint256_t &ent_hash, HotStuffBase *hs):
             promise_t([](promise_t){}),
-            hs(hs), ent_hash(ent_hash) {
-    fetch_msg = std::vector<uint256_t>{ent_hash};
-
+            hs(hs), ent_hash(ent_hash),
+            rto(ent_waiting_timeout),
+            retransmitted(false) {
     timeout = TimerEvent(hs->ec,
             std::bind(&FetchContext::timeout_cb, this, _1));
+    hedge_timer = TimerEvent(hs->ec,
+            std::bind(&FetchContext::hedge_cb, this, _1));
     reset_timeout();
 }
 
 template<EntityType ent_type>
 void FetchContext<ent_type>::send(const NetAddr &replica_id) {
     hs->part_fetched_replica[replica_id]++;
-    hs->pn.send_msg(fetch_msg, replica_id);
+    hs->queue_req_blk(ent_hash, replica_id);
+    note_sent(replica_id);
+}
+
+template<EntityType ent_type>
+void FetchContext<ent_type>::note_sent(const NetAddr &replica_id) {
+    if (!sent_time.insert(std::make_pair(replica_id, get_mono_time())).second ||
+        sent_time.size() > 1)
+        return;
+    /* the first request: time it by the RTT of the replica */
+    rto = hs->get_fetch_timeout(replica_id);
+    reset_timeout();
+    if (replica_ids.size() > 1)
+        hedge_timer.add(hs->get_hedge_delay(replica_id));
+}
+
+template<EntityType ent_type>
+void FetchContext<ent_type>::on_response(const NetAddr &replica_id) {
+    auto it = sent_time.find(replica_id);
+    if (it == sent_time.end() || retransmitted) return;
+    hs->peer_rtt[replica_id].add_sample(get_mono_time() - it->second);
 }
 
 template<EntityType ent_type>
 void FetchContext<ent_type>::reset_timeout() {
-    timeout.add(salticidae::gen_rand_timeout(ent_waiting_timeout));
+    timeout.add(rto);
 }
 
 template<EntityType ent_type>
 void FetchContext<ent_type>::add_replica(const NetAddr &replica_id, bool fetch_now) {
-    if (replica_ids.empty() && fetch_now)
-        send(replica_id);
-    replica_ids.insert(replica_id);
+    if (std::find(replica_ids.begin(), replica_ids.end(), replica_id) != replica_ids.end())
+        return;
+    replica_ids.push_back(replica_id);
+    if (replica_ids.size() == 1)
+    {
+        if (fetch_now) send(replica_id);
+    }
+    else if (replica_ids.size() == 2 && sent_time.size() == 1)
+        hedge_timer.add(hs->get_hedge_delay(replica_ids[0]));
 }
-
 }
 
 #endif
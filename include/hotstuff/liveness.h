@@ -18,6 +18,9 @@
 #ifndef _HOTSTUFF_LIVENESS_H
 #define _HOTSTUFF_LIVENESS_H
 
+#include <functional>
+#include <memory>
+
 #include "salticidae/util.h"
 #include "hotstuff/hotstuff.h"
 
@@ -26,12 +29,94 @@ namespace hotstuff {
 using salticidae::_1;
 using salticidae::_2;
 
+/** Clock for the pacemakers other than the event loop, e.g., the virtual
+ * clock of a simulator. */
+class PMClock {
+    public:
+    virtual ~PMClock() = default;
+    /** Current time in seconds. */
+    virtual double now() const = 0;
+    /** Call `cb` in `t_sec` seconds.
+     * @return a handle for `cancel`. */
+    virtual uint64_t schedule(double t_sec, std::function<void()> cb) = 0;
+    /** Cancel a scheduled call (no effect if it has already run). */
+    virtual void cancel(uint64_t handle) = 0;
+};
+
+/** One-shot timer of a pacemaker, firing on the event loop, or on `clock`
+ * if it is given. */
+class PMTimerEvent {
+    TimerEvent ev;
+    PMClock *clock;
+    /* shared with the scheduled call, so that the timer may be replaced
+     * from its own callback */
+    std::shared_ptr<std::function<void()>> callback;
+    uint64_t handle;
+
+    public:
+    PMTimerEvent(): clock(nullptr), handle(0) {}
+    PMTimerEvent(const EventContext &ec, PMClock *clock,
+                std::function<void()> cb): clock(clock), handle(0) {
+        if (clock)
+            callback = std::make_shared<std::function<void()>>(std::move(cb));
+        else
+            ev = TimerEvent(ec, [cb](TimerEvent &) { cb(); });
+    }
+    PMTimerEvent(const PMTimerEvent &) = delete;
+    PMTimerEvent(PMTimerEvent &&other):
+        ev(std::move(other.ev)), clock(other.clock),
+        callback(std::move(other.callback)), handle(other.handle) {
+        other.handle = 0;
+    }
+    PMTimerEvent &operator=(PMTimerEvent &&other) {
+        if (this != &other)
+        {
+            del();
+            ev = std::move(other.ev);
+            clock = other.clock;
+            callback = std::move(other.callback);
+            handle = other.handle;
+            other.handle = 0;
+        }
+        return *this;
+    }
+    ~PMTimerEvent() { if (clock) del(); }
+
+    void add(double t_sec) {
+        if (!clock)
+        {
+            ev.add(t_sec);
+            return;
+        }
+        del();
+        auto cb = callback;
+        handle = clock->schedule(t_sec, [cb]() { (*cb)(); });
+    }
+
+    void del() {
+        if (!clock)
+            ev.del();
+        else if (handle)
+        {
+            clock->cancel(handle);
+            handle = 0;
+        }
+    }
+};
+
 /** Abstraction for liveness gadget (oracle). */
 class PaceMaker {
     protected:
     HotStuffCore *hsc;
+    /** clock for the timers (the event loop if null) */
+    PMClock *clock = nullptr;
+    /** Current time on the pacemaker's clock. */
+    double get_time() const { return clock ? clock->now() : get_mono_time(); }
     public:
     virtual ~PaceMaker() = default;
+    /** Run the timers on `clock` instead of the event loop; should be called
+     * before `init`. */
+    void set_clock(PMClock *_clock) { clock = _clock; }
     /** Initialize the PaceMaker. A derived class should also call the
      * default implementation to set `hsc`. */
     virtual void init(HotStuffCore *_hsc) { hsc = _hsc; }
@@ -51,6 +136,9 @@ class PaceMaker {
     virtual promise_t beat_resp(ReplicaID last_proposer) = 0;
     /** Impeach the current proposer. */
     virtual void impeach() {}
+    /** Whether all replicas agree on `get_proposer()` and `impeach()`
+     * replaces it, so that watching the proposer's heartbeats is useful. */
+    virtual bool can_impeach() const { return false; }
     virtual void on_consensus(const block_t &) {}
     virtual size_t get_pending_size() = 0;
 };
@@ -74,9 +162,16 @@ class PMHighTail: public virtual PaceMaker {
     void reg_hqc_update() {
         hsc->async_hqc_update().then([this](const block_t &hqc) {
             hqc_tail = hqc;
+            /* the first (highest) tail extending hqc */
             for (const auto &tail: hsc->get_tails())
-                if (check_ancestry(hqc, tail) && tail->get_height() > hqc_tail->get_height())
+            {
+                if (tail->get_height() <= hqc->get_height()) break;
+                if (check_ancestry(hqc, tail))
+                {
                     hqc_tail = tail;
+                    break;
+                }
+            }
             reg_hqc_update();
         });
     }
@@ -107,23 +202,17 @@ class PMHighTail: public virtual PaceMaker {
         reg_receive_proposal();
     }
 
+    /** The highest tail extending hqc, followed by up to `parent_limit - 1`
+     * of the highest other tails as uncles/aunts (none unless
+     * `parent_limit` > 1). */
     std::vector<block_t> get_parents() override {
-        const auto &tails = hsc->get_tails();
         std::vector<block_t> parents{hqc_tail};
-        // TODO: inclusive block chain
-        // auto nparents = tails.size();
-        // if (parent_limit > 0)
-        //     nparents = std::min(nparents, (size_t)parent_limit);
-        // nparents--;
-        // /* add the rest of tails as "uncles/aunts" */
-        // for (const auto &blk: tails)
-        // {
-        //     if (blk != hqc_tail)
-        //     {
-        //         parents.push_back(blk);
-        //         if (!--nparents) break;
-        //     }
-        // }
+        if (parent_limit <= 1) return std::move(parents);
+        for (const auto &blk: hsc->get_tails())
+        {
+            if (parents.size() >= (size_t)parent_limit) break;
+            if (blk != hqc_tail) parents.push_back(blk);
+        }
         return std::move(parents);
     }
 };
@@ -224,6 +313,89 @@ class PaceMakerDummyFixed: public PaceMakerDummy {
     }
 };
 
+/** Fallback for the tree overlay: if a proposal does not get its QC within
+ * `timeout` (e.g., an inner replica is down), the proposer re-sends it by
+ * direct broadcast, and the replicas answer with direct votes. After a
+ * fallback, the following proposals are re-sent right away for
+ * `star_hold` timeouts, then the tree is tried again. */
+class PMTreeFallback: public virtual PaceMaker {
+    static constexpr double star_hold = 10;
+    struct Pending {
+        PMTimerEvent timer;
+        promise_t qc_finish;
+        bool fired;
+    };
+    EventContext ec;
+    double timeout;
+    double star_until;
+    /** proposals sent over the tree and still waiting for their QC */
+    std::unordered_map<uint256_t, Pending> pending;
+
+    void fall_back(const Proposal &prop) {
+        static_cast<HotStuffBase *>(hsc)->broadcast_proposal_star(prop);
+    }
+
+    void reg_proposal() {
+        hsc->async_wait_proposal().then([this](const Proposal &prop) {
+            /* timers cannot be freed from their own callback */
+            for (auto it = pending.begin(); it != pending.end();)
+                if (it->second.fired)
+                    it = pending.erase(it);
+                else
+                    it++;
+            if (get_time() < star_until)
+                fall_back(prop);
+            else
+                wait_tree_qc(prop);
+            reg_proposal();
+        });
+    }
+
+    void wait_tree_qc(const Proposal &prop) {
+        const uint256_t blk_hash = prop.blk->get_hash();
+        auto &p = pending[blk_hash];
+        p.fired = false;
+        p.timer = PMTimerEvent(ec, clock, [this, prop, blk_hash]() {
+            HOTSTUFF_LOG_WARN("no QC for %s over the tree, fall back to star",
+                            get_hex10(blk_hash).c_str());
+            star_until = get_time() + star_hold * timeout;
+            fall_back(prop);
+            auto &p = pending[blk_hash];
+            p.fired = true;
+            p.qc_finish.reject();
+        });
+        p.timer.add(timeout);
+        promise_t pm = hsc->async_qc_finish(prop.blk);
+        p.qc_finish = pm;
+        pm.then([this, blk_hash]() {
+            auto it = pending.find(blk_hash);
+            if (it == pending.end() || it->second.fired) return;
+            it->second.timer.del();
+            pending.erase(it);
+        });
+    }
+
+    public:
+    PMTreeFallback(const EventContext &ec, double timeout):
+        ec(ec), timeout(timeout), star_until(0) {}
+
+    void init() { reg_proposal(); }
+};
+
+/** PaceMakerDummyFixed over the tree overlay, falling back to direct
+ * broadcast on timeout. */
+struct PaceMakerTree: public PaceMakerDummyFixed, public PMTreeFallback {
+    PaceMakerTree(EventContext ec, ReplicaID proposer, int32_t parent_limit,
+                double timeout = 1):
+        PaceMakerDummyFixed(proposer, parent_limit),
+        PMTreeFallback(ec, timeout) {}
+
+    void init(HotStuffCore *hsc) override {
+        PaceMakerDummyFixed::init(hsc);
+        PMTreeFallback::init();
+    }
+};
+
 /**
  * Simple long-standing round-robin style proposer liveness gadget.
  */
@@ -233,7 +405,7 @@ class PMRoundRobinProposer: virtual public PaceMaker {
     double prop_delay;
     EventContext ec;
     /** QC timer or randomized timeout */
-    TimerEvent timer;
+    PMTimerEvent timer;
     /** the proposer it believes */
     ReplicaID proposer;
     std::unordered_map<ReplicaID, block_t> prop_blk;
@@ -293,21 +465,27 @@ class PMRoundRobinProposer: virtual public PaceMaker {
         auto blk = hsc->on_propose(cmds, get_parents(), bytearray_t());
         pm_qc_manual.reject();
         (pm_qc_manual = hsc->async_qc_finish(blk))
-            .then([this, x]() {
+            .then([this, x, blk]() {
                 HOTSTUFF_LOG_PROTO("Pacemaker: got QC for block %d", x);
+                /* the QC of the last block in the chain does not need a
+                 * block of its own to commit the first */
 #ifdef HOTSTUFF_TWO_STEP
-                if (x >= 2) return;
+                if (x >= 1)
 #else
-                if (x >= 3) return;
+                if (x >= 2)
 #endif
+                {
+                    hsc->flush_qc(blk);
+                    return;
+                }
                 do_new_consensus(x + 1, std::vector<uint256_t>{});
             });
     }
 
-    void on_exp_timeout(TimerEvent &) {
+    void on_exp_timeout() {
         if (proposer == hsc->get_id())
             do_new_consensus(0, std::vector<uint256_t>{});
-        timer = TimerEvent(ec, [this](TimerEvent &){ rotate(); });
+        timer = PMTimerEvent(ec, clock, [this]() { rotate(); });
         timer.add(prop_delay);
     }
 
@@ -318,13 +496,13 @@ class PMRoundRobinProposer: virtual public PaceMaker {
         reg_receive_proposal();
         prop_blk.clear();
         rotating = true;
-        proposer = (proposer + 1) % hsc->get_config().nreplicas;
+        proposer = next_proposer(proposer);
         HOTSTUFF_LOG_PROTO("Pacemaker: rotate to %d", proposer);
         pm_qc_finish.reject();
         pm_wait_propose.reject();
         pm_qc_manual.reject();
         // start timer
-        timer = TimerEvent(ec, salticidae::generic_bind(&PMRoundRobinProposer::on_exp_timeout, this, _1));
+        timer = PMTimerEvent(ec, clock, [this]() { on_exp_timeout(); });
         timer.add(exp_timeout);
         exp_timeout *= 2;
     }
@@ -339,9 +517,10 @@ class PMRoundRobinProposer: virtual public PaceMaker {
         locked = false;
         last_proposed = hsc->get_genesis();
         proposer_update_last_proposed();
-        if (proposer == hsc->get_id())
+        /* not on top of the network (e.g., in a simulation) */
+        auto hs = dynamic_cast<hotstuff::HotStuffBase *>(hsc);
+        if (hs && proposer == hsc->get_id())
         {
-            auto hs = static_cast<hotstuff::HotStuffBase *>(hsc);
             hs->do_elected();
             hs->get_tcall().async_call([this, hs](salticidae::ThreadCall::Handle &) {
                 auto &pending = hs->get_decision_waiting();
@@ -356,9 +535,18 @@ class PMRoundRobinProposer: virtual public PaceMaker {
     }
 
     protected:
+    /** The timeout for the first proposer of a rotation, doubled for each
+     * following one. */
+    virtual double get_base_timeout() { return base_timeout; }
+
+    /** The proposer to rotate to after `cur`. */
+    virtual ReplicaID next_proposer(ReplicaID cur) {
+        return (cur + 1) % hsc->get_config().nreplicas;
+    }
+
     void on_consensus(const block_t &blk) override {
         timer.del();
-        exp_timeout = base_timeout;
+        exp_timeout = get_base_timeout();
         if (prop_blk[proposer] == blk)
             stop_rotate();
     }
@@ -369,6 +557,8 @@ class PMRoundRobinProposer: virtual public PaceMaker {
         HOTSTUFF_LOG_INFO("schedule to impeach the proposer");
     }
 
+    bool can_impeach() const override { return true; }
+
     public:
     PMRoundRobinProposer(const EventContext &ec,
                         double base_timeout, double prop_delay):
@@ -379,7 +569,7 @@ class PMRoundRobinProposer: virtual public PaceMaker {
     size_t get_pending_size() override { return pending_beats.size(); }
 
     void init() {
-        exp_timeout = base_timeout;
+        exp_timeout = get_base_timeout();
         stop_rotate();
     }
 
@@ -421,6 +611,416 @@ struct PaceMakerRR: public PMHighTail, public PMRoundRobinProposer {
     }
 };
 
+/** Measures how long blocks take to get a QC (seen as the QC reference of a
+ * later proposal) and to be committed, both counted from when the block was
+ * first proposed or received, and derives a timeout from a high percentile
+ * of them. */
+class PMLatencyTimeout: public virtual PaceMaker {
+    static constexpr size_t history_size = 1024;
+    /** slack over the observed latency */
+    static constexpr double margin = 2;
+#ifdef HOTSTUFF_TWO_STEP
+    static constexpr double nphase = 2;
+#else
+    static constexpr double nphase = 3;
+#endif
+    struct BlockTime {
+        double seen;
+        bool qc_sampled;
+    };
+    double pct;
+    double min_timeout;
+    double max_timeout;
+    std::unordered_map<uint256_t, BlockTime> blk_time;
+    std::queue<uint256_t> blk_history;
+    RTTEstimator qc_lat;
+    RTTEstimator commit_lat;
+
+    void on_seen(const block_t &blk) {
+        double now = get_time();
+        if (blk_time.insert(std::make_pair(blk->get_hash(),
+                                        BlockTime{now, false})).second)
+        {
+            blk_history.push(blk->get_hash());
+            if (blk_history.size() > history_size)
+            {
+                blk_time.erase(blk_history.front());
+                blk_history.pop();
+            }
+        }
+    }
+
+    /* sample when the QC forms (the vote collector) or is first learnt,
+     * rather than when a later proposal happens to reference the block,
+     * which would count the idle time in between */
+    void reg_hqc_update() {
+        hsc->async_hqc_update().then([this](const block_t &hqc) {
+            auto it = blk_time.find(hqc->get_hash());
+            if (it != blk_time.end() && !it->second.qc_sampled)
+            {
+                it->second.qc_sampled = true;
+                qc_lat.add_sample(get_time() - it->second.seen);
+            }
+            reg_hqc_update();
+        });
+    }
+
+    void reg_proposal() {
+        hsc->async_wait_proposal().then([this](const Proposal &prop) {
+            on_seen(prop.blk);
+            reg_proposal();
+        });
+    }
+
+    void reg_receive_proposal() {
+        hsc->async_wait_receive_proposal().then([this](const Proposal &prop) {
+            on_seen(prop.blk);
+            reg_receive_proposal();
+        });
+    }
+
+    protected:
+    void record_commit(const block_t &blk) {
+        auto it = blk_time.find(blk->get_hash());
+        if (it != blk_time.end())
+            commit_lat.add_sample(get_time() - it->second.seen);
+    }
+
+    /** The timeout to use, or `fallback` before any latency is observed. */
+    double get_latency_timeout(double fallback) const {
+        if (qc_lat.empty() && commit_lat.empty()) return fallback;
+        double t = 0;
+        if (!commit_lat.empty())
+            t = commit_lat.get_percentile(pct);
+        if (!qc_lat.empty())
+            t = std::max(t, nphase * qc_lat.get_percentile(pct));
+        return std::max(min_timeout, std::min(max_timeout, margin * t));
+    }
+
+    public:
+    PMLatencyTimeout(double pct, double min_timeout, double max_timeout):
+        pct(pct), min_timeout(min_timeout), max_timeout(max_timeout) {
+        if (!(0 < pct && pct < 1))
+            throw std::invalid_argument("latency percentile should be in (0, 1)");
+        if (min_timeout > max_timeout)
+            throw std::invalid_argument("min_timeout exceeds max_timeout");
+    }
+
+    void init() {
+        reg_proposal();
+        reg_receive_proposal();
+        reg_hqc_update();
+    }
+};
+
+/** PaceMakerRR whose rotation timeout follows the observed QC/commit latency
+ * (`base_timeout` is only used until the first measurement). */
+struct PaceMakerRRAdaptive: public PMHighTail, public PMRoundRobinProposer,
+                            public PMLatencyTimeout {
+    PaceMakerRRAdaptive(EventContext ec, int32_t parent_limit,
+                        double base_timeout, double prop_delay,
+                        double pct, double min_timeout, double max_timeout):
+        PMHighTail(parent_limit),
+        PMRoundRobinProposer(ec, base_timeout, prop_delay),
+        PMLatencyTimeout(pct, min_timeout, max_timeout) {}
+
+    void init(HotStuffCore *hsc) override {
+        PaceMaker::init(hsc);
+        PMHighTail::init();
+        PMLatencyTimeout::init();
+        PMRoundRobinProposer::init();
+    }
+
+    protected:
+    double get_base_timeout() override {
+        return get_latency_timeout(PMRoundRobinProposer::get_base_timeout());
+    }
+
+    void on_consensus(const block_t &blk) override {
+        record_commit(blk);
+        PMRoundRobinProposer::on_consensus(blk);
+    }
+};
+
+/** Reputation of the replicas derived from the committed chain: every
+ * `window` committed heights, the replicas that signed none of the QCs
+ * carried by the blocks of that span (i.e., were down, or too slow to be
+ * among the first votes) are excluded from the proposer schedule for the
+ * next span. As it only depends on the committed chain, all replicas that
+ * have committed the same span agree on the schedule. */
+class PMLeaderReputation: public virtual PaceMaker {
+    uint32_t window;
+    /** number of QCs signed by each replica in the current span */
+    std::vector<uint32_t> nsigned;
+    /** replicas eligible to propose (all while empty) */
+    std::vector<bool> active;
+
+    void close_span() {
+        size_t n = hsc->get_config().nreplicas;
+        size_t nactive = 0;
+        for (size_t i = 0; i < n; i++)
+            if (nsigned[i]) nactive++;
+        active.assign(n, false);
+        for (size_t i = 0; i < n; i++)
+        {
+            /* never exclude everyone */
+            active[i] = nsigned[i] > 0 || nactive == 0;
+            if (!active[i])
+                HOTSTUFF_LOG_INFO("Pacemaker: replica %lu signed no QC "
+                                    "in the last %u blocks, skipping it", i, window);
+        }
+        nsigned.assign(n, 0);
+    }
+
+    protected:
+    void record_commit(const block_t &blk) {
+        size_t n = hsc->get_config().nreplicas;
+        if (nsigned.size() != n) nsigned.assign(n, 0);
+        if (const auto &qc = blk->get_qc())
+        {
+            const auto &rids = qc->get_rids();
+            for (size_t i = 0; i < n && i < rids.size(); i++)
+                if (rids.get(i)) nsigned[i]++;
+        }
+        if (blk->get_height() % window == 0)
+            close_span();
+    }
+
+    /** The first eligible replica after `cur` in round-robin order. */
+    ReplicaID next_eligible(ReplicaID cur) const {
+        size_t n = hsc->get_config().nreplicas;
+        for (size_t i = 1; i <= n; i++)
+        {
+            ReplicaID rid = (cur + i) % n;
+            if (active.size() != n || active[rid]) return rid;
+        }
+        return (cur + 1) % n;
+    }
+
+    public:
+    PMLeaderReputation(uint32_t window): window(window) {
+        if (window == 0)
+            throw std::invalid_argument("reputation window should be positive");
+    }
+};
+
+/** PaceMakerRR that skips the proposers with a bad reputation. */
+struct PaceMakerRRReputation: public PMHighTail, public PMRoundRobinProposer,
+                            public PMLeaderReputation {
+    PaceMakerRRReputation(EventContext ec, int32_t parent_limit,
+                        double base_timeout, double prop_delay,
+                        uint32_t window):
+        PMHighTail(parent_limit),
+        PMRoundRobinProposer(ec, base_timeout, prop_delay),
+        PMLeaderReputation(window) {}
+
+    void init(HotStuffCore *hsc) override {
+        PaceMaker::init(hsc);
+        PMHighTail::init();
+        PMRoundRobinProposer::init();
+    }
+
+    protected:
+    ReplicaID next_proposer(ReplicaID cur) override {
+        return next_eligible(cur);
+    }
+
+    void on_consensus(const block_t &blk) override {
+        record_commit(blk);
+        PMRoundRobinProposer::on_consensus(blk);
+    }
+};
+
+/** Proposer rotation on every block: the replica after the proposer of the
+ * latest block is the next leader, collects the votes for that block and
+ * proposes as soon as it holds the QC (as in PMWaitQC). If the next leader
+ * does not propose within the timeout, the replicas move on to the one
+ * after it, which then proposes on the highest QC it knows. */
+class PMRotatePerBlock: public virtual PaceMaker {
+#ifdef HOTSTUFF_TWO_STEP
+    static constexpr size_t nphase = 2;
+#else
+    static constexpr size_t nphase = 3;
+#endif
+    EventContext ec;
+    double base_timeout;
+    double timeout;
+    PMTimerEvent timer;
+    bool timer_armed;
+    /** latest block proposed (by anyone) and its proposer */
+    block_t last_blk;
+    ReplicaID last_proposer;
+    /** number of leaders skipped since last_blk */
+    size_t nskip;
+    /** the leader may propose now */
+    bool ready;
+    /** the leader holds the QC for last_blk */
+    bool qc_held;
+    /** the leader has proposed for this turn */
+    bool proposed;
+    std::queue<promise_t> pending_beats;
+    promise_t pm_qc_finish;
+
+    ReplicaID get_leader() const {
+        return (last_proposer + 1 + nskip) % hsc->get_config().nreplicas;
+    }
+
+    /** Whether the chain ending at `blk` still has commands that take more
+     * (possibly empty) blocks on top to commit. */
+    bool needs_flush(const block_t &blk) const {
+        return has_pending_cmds(blk, nphase);
+    }
+
+    /** Whether any of the `depth` blocks ending at `blk` has commands yet to
+     * be committed. */
+    static bool has_pending_cmds(block_t blk, size_t depth) {
+        for (size_t i = 0; i < depth && blk; i++)
+        {
+            if (blk->get_decision() != 1 && !blk->get_cmds().empty())
+                return true;
+            const auto &parents = blk->get_parents();
+            blk = parents.empty() ? nullptr : parents[0];
+        }
+        return false;
+    }
+
+    void arm_timer() {
+        timer.del();
+        timer_armed = !pending_beats.empty() || needs_flush(last_blk);
+        if (timer_armed) timer.add(timeout);
+    }
+
+    void on_timeout() {
+        timer_armed = false;
+        nskip++;
+        timeout *= 2;
+        HOTSTUFF_LOG_PROTO("Pacemaker: no proposal in time, skip to %d", get_leader());
+        /* the skipped leader held the votes, so propose on the highest QC */
+        ready = true;
+        qc_held = false;
+        proposed = false;
+        pm_qc_finish.reject();
+        try_propose();
+        arm_timer();
+    }
+
+    void try_propose() {
+        if (get_leader() != hsc->get_id() || !ready || proposed) return;
+        if (!pending_beats.empty())
+        {
+            proposed = true;
+            auto pm = pending_beats.front();
+            pending_beats.pop();
+            pm.resolve(hsc->get_id());
+        }
+        else if (needs_flush(last_blk))
+        {
+            proposed = true;
+            /* only the deepest block has commands left: its QC commits it */
+            if (qc_held && !has_pending_cmds(last_blk, nphase - 1))
+            {
+                hsc->flush_qc(last_blk);
+                /* still our turn for new commands */
+                proposed = false;
+            }
+            else
+                hsc->on_propose(std::vector<uint256_t>{}, get_parents(), bytearray_t());
+        }
+    }
+
+    void on_new_proposal(const Proposal &prop) {
+        if (last_blk && prop.blk->get_height() <= last_blk->get_height())
+            return;
+        last_blk = prop.blk;
+        last_proposer = prop.proposer;
+        nskip = 0;
+        timeout = base_timeout;
+        ready = false;
+        qc_held = false;
+        proposed = false;
+        pm_qc_finish.reject();
+        if (get_leader() == hsc->get_id())
+        {
+            (pm_qc_finish = hsc->async_qc_finish(last_blk)).then([this]() {
+                HOTSTUFF_LOG_PROTO("got QC, propose a new block");
+                ready = true;
+                qc_held = true;
+                try_propose();
+            });
+        }
+        arm_timer();
+    }
+
+    void reg_proposal() {
+        hsc->async_wait_proposal().then([this](const Proposal &prop) {
+            on_new_proposal(prop);
+            reg_proposal();
+        });
+    }
+
+    void reg_receive_proposal() {
+        hsc->async_wait_receive_proposal().then([this](const Proposal &prop) {
+            on_new_proposal(prop);
+            reg_receive_proposal();
+        });
+    }
+
+    public:
+    PMRotatePerBlock(const EventContext &ec, double base_timeout):
+        ec(ec), base_timeout(base_timeout), timeout(base_timeout),
+        timer_armed(false), nskip(0), ready(true), qc_held(true), proposed(false) {}
+
+    void init() {
+        timer = PMTimerEvent(ec, clock, [this]() { on_timeout(); });
+        /* the next leader needs our vote for our own block as well */
+        hsc->set_self_vote_forwarded(true);
+        last_blk = hsc->get_genesis();
+        /* replica 0 proposes first */
+        last_proposer = hsc->get_config().nreplicas - 1;
+        reg_proposal();
+        reg_receive_proposal();
+    }
+
+    /** A flushed QC may commit the last block: stop waiting for more. */
+    void on_consensus(const block_t &) override { arm_timer(); }
+
+    /** Any replica may take commands: they are proposed on its turn. */
+    ReplicaID get_proposer() override { return hsc->get_id(); }
+
+    size_t get_pending_size() override { return pending_beats.size(); }
+
+    promise_t beat() override {
+        promise_t pm;
+        pending_beats.push(pm);
+        try_propose();
+        if (!pending_beats.empty() && !timer_armed) arm_timer();
+        return std::move(pm);
+    }
+
+    /** Votes for the latest block go to its current leader, past any that
+     * were skipped. */
+    promise_t beat_resp(ReplicaID last_proposer) override {
+        return promise_t([this, last_proposer](promise_t &pm) {
+            pm.resolve(last_proposer == this->last_proposer ? get_leader() :
+                    (last_proposer + 1) % hsc->get_config().nreplicas);
+        });
+    }
+};
+
+/** Per-block leader rotation over PMHighTail parent selection. */
+struct PaceMakerRotating: public PMHighTail, public PMRotatePerBlock {
+    PaceMakerRotating(EventContext ec, int32_t parent_limit,
+                    double base_timeout = 1):
+        PMHighTail(parent_limit),
+        PMRotatePerBlock(ec, base_timeout) {}
+
+    void init(HotStuffCore *hsc) override {
+        PaceMaker::init(hsc);
+        PMHighTail::init();
+        PMRotatePerBlock::init();
+    }
+};
+
 }
 
 #endif
@@ -18,95 +18,311 @@
 #define _HOTSTUFF_WORKER_H
 
 #include <thread>
-#include <unordered_map>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <optional>
+#include <vector>
+#include <type_traits>
 #include <unistd.h>
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
 
 #include "salticidae/event.h"
 #include "hotstuff/util.h"
 
 namespace hotstuff {
 
+/** Shared completion state of a batch of tasks (e.g., all signatures of a
+ * QC), resolved once every task in the batch has finished. */
+struct VeriGroup {
+    size_t nleft;
+    bool result;
+    promise_t pm;
+};
+
 class VeriTask {
     friend class VeriPool;
     bool result;
+    /** completion slot travelling with an offloaded single task, only
+     * touched by the thread owning the pool (batched tasks resolve their
+     * group instead, and inline tasks need none, so neither allocates) */
+    std::optional<promise_t> pm;
+    VeriGroup *group;
     public:
     virtual bool verify() = 0;
+    /** Resolve the task's promise on the owner thread; tasks producing
+     * something other than a verdict override this. */
+    virtual void finish(promise_t &pm, bool result) { pm.resolve(result); }
     virtual ~VeriTask() = default;
 };
 
 using salticidae::ThreadCall;
-using veritask_ut = BoxObj<VeriTask>;
-using mpmc_queue_t = salticidae::MPMCQueueEventDriven<VeriTask *>;
 using mpsc_queue_t = salticidae::MPSCQueueEventDriven<VeriTask *>;
 
 class VeriPool {
-    mpmc_queue_t in_queue;
+    /** every task type should fit in one slot */
+    static const size_t task_slot_size = 192;
+    static const size_t slab_nslot = 256;
+    using task_slot_t = std::aligned_storage<
+        task_slot_size, alignof(std::max_align_t)>::type;
+
     mpsc_queue_t out_queue;
 
+    /** Each worker owns a deque: it pops from the front of its own and
+     * steals from the back of the others when it runs dry. */
     struct Worker {
         std::thread handle;
-        EventContext ec;
-        BoxObj<ThreadCall> tcall;
+        std::mutex mlock;
+        std::deque<VeriTask *> tasks;
     };
 
-    std::vector<Worker> workers;
-    std::unordered_map<VeriTask *, std::pair<veritask_ut, promise_t>> pms;
+    std::vector<BoxObj<Worker>> workers;
+    /** number of tasks sitting in the deques (bumped before they are pushed) */
+    std::atomic<size_t> nqueued;
+    std::atomic<bool> stopped;
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    /** next worker to receive a submission (owner thread only) */
+    size_t next_worker;
+    /** tasks submitted but not yet completed (owner thread only) */
+    size_t noutstanding;
+    /** single tasks are verified on the caller thread while fewer than
+     * `inline_depth` tasks are outstanding */
+    size_t inline_depth;
+    size_t ninline;
+    size_t noffload;
+
+    /* task slots are recycled by the owner thread, so no locking here */
+    std::vector<std::unique_ptr<task_slot_t[]>> slabs;
+    std::vector<void *> free_slots;
+    /** tasks added to the batch being built */
+    std::vector<VeriTask *> batch;
+
+    static_assert(sizeof(VeriGroup) <= task_slot_size, "VeriGroup does not fit in a slot");
+
+    void *alloc_slot() {
+        if (free_slots.empty())
+        {
+            slabs.emplace_back(new task_slot_t[slab_nslot]);
+            auto slab = slabs.back().get();
+            for (size_t i = 0; i < slab_nslot; i++)
+                free_slots.push_back(slab + i);
+        }
+        auto slot = free_slots.back();
+        free_slots.pop_back();
+        return slot;
+    }
+
+    void release(VeriTask *task) {
+        void *slot = dynamic_cast<void *>(task);
+        task->~VeriTask();
+        free_slots.push_back(slot);
+    }
+
+    void release(VeriGroup *group) {
+        group->~VeriGroup();
+        free_slots.push_back(group);
+    }
+
+    template<typename Task, typename... Args>
+    Task *new_task(Args &&...args) {
+        static_assert(std::is_base_of<VeriTask, Task>::value,
+                    "Task should be derived from VeriTask");
+        static_assert(sizeof(Task) <= task_slot_size &&
+                    alignof(Task) <= alignof(task_slot_t),
+                    "Task does not fit in a slot");
+        auto task = new (alloc_slot()) Task(std::forward<Args>(args)...);
+        task->group = nullptr;
+        return task;
+    }
+
+    /** Hand tasks to one worker under a single lock acquisition; idle
+     * workers will steal from it. */
+    void submit(VeriTask *const *tasks, size_t ntask) {
+        noutstanding += ntask;
+        noffload += ntask;
+        auto &w = *workers[next_worker];
+        if (++next_worker == workers.size()) next_worker = 0;
+        nqueued.fetch_add(ntask, std::memory_order_release);
+        {
+            std::lock_guard<std::mutex> _(w.mlock);
+            w.tasks.insert(w.tasks.end(), tasks, tasks + ntask);
+        }
+        { std::lock_guard<std::mutex> _(idle_lock); }
+        if (ntask > 1)
+            idle_cv.notify_all();
+        else
+            idle_cv.notify_one();
+    }
+
+    VeriTask *take(size_t idx) {
+        VeriTask *task = nullptr;
+        for (size_t i = 0; i < workers.size() && !task; i++)
+        {
+            auto &w = *workers[(idx + i) % workers.size()];
+            std::lock_guard<std::mutex> _(w.mlock);
+            if (w.tasks.empty()) continue;
+            if (i == 0)
+            {
+                task = w.tasks.front();
+                w.tasks.pop_front();
+            }
+            else
+            {
+                task = w.tasks.back();
+                w.tasks.pop_back();
+            }
+        }
+        if (task) nqueued.fetch_sub(1, std::memory_order_relaxed);
+        return task;
+    }
+
+    void worker_loop(size_t idx) {
+        for (;;)
+        {
+            VeriTask *task = take(idx);
+            if (task)
+            {
+                HOTSTUFF_LOG_DEBUG("%lx working on %u",
+                                    std::this_thread::get_id(), (uintptr_t)task);
+                task->result = task->verify();
+                out_queue.enqueue(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(idle_lock);
+            idle_cv.wait(lk, [this]() {
+                return stopped.load() || nqueued.load(std::memory_order_acquire) > 0;
+            });
+            if (stopped.load()) return;
+        }
+    }
 
     public:
-    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128) {
+    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128):
+            nqueued(0), stopped(false), next_worker(0),
+            noutstanding(0), inline_depth(1), ninline(0), noffload(0) {
+        if (nworker == 0)
+            throw std::invalid_argument("VeriPool needs at least one worker");
         out_queue.reg_handler(ec, [this, burst_size](mpsc_queue_t &q) {
             size_t cnt = burst_size;
             VeriTask *task;
             while (q.try_dequeue(task))
             {
-                auto it = pms.find(task);
-                it->second.second.resolve(task->result);
-                pms.erase(it);
+                noutstanding--;
+                if (auto group = task->group)
+                {
+                    group->result &= task->result;
+                    release(task);
+                    if (!--group->nleft)
+                    {
+                        auto pm = std::move(group->pm);
+                        bool result = group->result;
+                        release(group);
+                        pm.resolve(result);
+                    }
+                }
+                else
+                {
+                    auto pm = std::move(*task->pm);
+                    task->finish(pm, task->result);
+                    release(task);
+                }
                 if (!--cnt) return true;
             }
             return false;
         });
 
-        workers.resize(nworker);
         for (size_t i = 0; i < nworker; i++)
+            workers.emplace_back(new Worker());
+        for (size_t i = 0; i < nworker; i++)
+            workers[i]->handle = std::thread([this, i]() { worker_loop(i); });
+    }
+
+    ~VeriPool() {
+        stopped.store(true);
+        { std::lock_guard<std::mutex> _(idle_lock); }
+        idle_cv.notify_all();
+        for (auto &w: workers)
+            w->handle.join();
+    }
+
+    /** Pin worker i to `cpus[i % cpus.size()]`. */
+    void pin_workers(const std::vector<int> &cpus) {
+        if (cpus.empty()) return;
+#ifdef __linux__
+        for (size_t i = 0; i < workers.size(); i++)
         {
-            in_queue.reg_handler(workers[i].ec, [this, burst_size](mpmc_queue_t &q) {
-                size_t cnt = burst_size;
-                VeriTask *task;
-                while (q.try_dequeue(task))
-                {
-                    HOTSTUFF_LOG_DEBUG("%lx working on %u",
-                                        std::this_thread::get_id(), (uintptr_t)task);
-                    task->result = task->verify();
-                    out_queue.enqueue(task);
-                    if (!--cnt) return true;
-                }
-                return false;
-            });
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpus[i % cpus.size()], &cpuset);
+            if (pthread_setaffinity_np(workers[i]->handle.native_handle(),
+                                        sizeof(cpu_set_t), &cpuset))
+                HOTSTUFF_LOG_WARN("failed to pin verification worker %lu to cpu %d",
+                                    i, cpus[i % cpus.size()]);
         }
-        for (auto &w: workers)
+#else
+        HOTSTUFF_LOG_WARN("cpu affinity is not supported on this platform");
+#endif
+    }
+
+    /** Set the queue depth below which single tasks are run inline (0
+     * always offloads). */
+    void set_inline_depth(size_t depth) { inline_depth = depth; }
+    size_t get_ninline() const { return ninline; }
+    size_t get_noffload() const { return noffload; }
+    size_t get_noutstanding() const { return noutstanding; }
+
+    /** Construct a task of type `Task` in a recycled slot and hand it to the
+     * workers, or verify it right away when the pool is (nearly) idle, which
+     * saves two cross-thread wakeups. The returned promise is resolved with
+     * the verification result. */
+    template<typename Task, typename... Args>
+    promise_t verify(Args &&...args) {
+        VeriTask *task = new_task<Task>(std::forward<Args>(args)...);
+        promise_t pm;
+        if (noutstanding < inline_depth)
         {
-            w.tcall = new ThreadCall(w.ec);
-            w.handle = std::thread([ec=w.ec]() { ec.dispatch(); });
+            ninline++;
+            task->finish(pm, task->verify());
+            release(task);
+            return pm;
         }
+        task->pm = pm;
+        submit(&task, 1);
+        return pm;
     }
 
-    ~VeriPool() {
-        for (auto &w: workers)
-            w.tcall->async_call([ec=w.ec](ThreadCall::Handle &) {
-                ec.stop();
-            });
-        for (auto &w: workers)
-            w.handle.join();
+    /** Add a task to the batch being built; nothing is run until
+     * `batch_submit()`. */
+    template<typename Task, typename... Args>
+    void batch_add(Args &&...args) {
+        batch.push_back(new_task<Task>(std::forward<Args>(args)...));
+    }
+
+    /** Drop the tasks of the batch being built. */
+    void batch_cancel() {
+        for (auto task: batch) release(task);
+        batch.clear();
     }
 
-    promise_t verify(veritask_ut &&task) {
-        auto ptr = task.get();
-        auto ret = pms.insert(std::make_pair(ptr,
-                std::make_pair(std::move(task), promise_t([](promise_t &){}))));
-        assert(ret.second);
-        in_queue.enqueue(ptr);
-        return ret.first->second.second;
+    /** Submit the batch being built as a whole. The returned promise is
+     * resolved with true only if all tasks in the batch pass. */
+    promise_t batch_submit() {
+        if (batch.empty())
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        auto group = new (alloc_slot()) VeriGroup();
+        group->nleft = batch.size();
+        group->result = true;
+        for (auto task: batch) task->group = group;
+        promise_t pm = group->pm;
+        submit(batch.data(), batch.size());
+        batch.clear();
+        return pm;
     }
 };
 
@@ -17,6 +17,12 @@
 #ifndef _HOTSTUFF_UTIL_H
 #define _HOTSTUFF_UTIL_H
 
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
 #include "hotstuff/config.h"
 #include "salticidae/util.h"
 
@@ -77,6 +83,221 @@ extern Logger logger;
 
 #define HOTSTUFF_LOG_ERROR(...) hotstuff::logger.error(__VA_ARGS__)
 
+/** Seconds on a monotonic clock (only meaningful as differences). */
+inline double get_mono_time() {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/** Round-trip time estimator in the style of TCP (RFC 6298), also keeping a
+ * window of recent samples for percentiles. */
+class RTTEstimator {
+    static constexpr size_t window = 64;
+    double srtt;
+    double rttvar;
+    std::vector<double> samples;
+    size_t next;
+
+    public:
+    RTTEstimator(): srtt(0), rttvar(0), next(0) {}
+
+    void add_sample(double rtt) {
+        if (samples.empty())
+        {
+            srtt = rtt;
+            rttvar = rtt / 2;
+        }
+        else
+        {
+            rttvar = 0.75 * rttvar + 0.25 * std::fabs(srtt - rtt);
+            srtt = 0.875 * srtt + 0.125 * rtt;
+        }
+        if (samples.size() < window)
+            samples.push_back(rtt);
+        else
+            samples[next] = rtt;
+        next = (next + 1) % window;
+    }
+
+    bool empty() const { return samples.empty(); }
+    double get_srtt() const { return srtt; }
+    double get_rto() const { return srtt + 4 * rttvar; }
+
+    /** The p-th (0 < p < 1) percentile over the recent samples. */
+    double get_percentile(double p) const {
+        std::vector<double> s(samples);
+        auto it = s.begin() + std::min(s.size() - 1, (size_t)(p * s.size()));
+        std::nth_element(s.begin(), it, s.end());
+        return *it;
+    }
+};
+
+/** Phi-accrual failure detector (Hayashibara et al.): the suspicion level
+ * of a peer grows with the time since its last heartbeat, relative to the
+ * distribution (approximated as normal) of recent inter-arrival times. */
+class PhiAccrualDetector {
+    static constexpr size_t window = 100;
+    std::vector<double> intervals;
+    size_t next;
+    double last;
+    /** a heartbeat has arrived since the reset */
+    bool primed;
+
+    public:
+    PhiAccrualDetector(): next(0), last(0), primed(false) {}
+
+    /** Forget the history, starting afresh at `now` (the grace period). */
+    void reset(double now) {
+        intervals.clear();
+        next = 0;
+        last = now;
+        primed = false;
+    }
+
+    void heartbeat(double now) {
+        /* the time from the reset to the first heartbeat is no interval */
+        if (!primed)
+        {
+            primed = true;
+            last = now;
+            return;
+        }
+        double t = now - last;
+        last = now;
+        if (intervals.size() < window)
+            intervals.push_back(t);
+        else
+            intervals[next] = t;
+        next = (next + 1) % window;
+    }
+
+    /** Suspicion level at `now`; `expected` is the nominal interval, used
+     * before any heartbeat arrives and as a floor of the deviation, and
+     * `pause` an acceptable extra delay added to the mean (as in Akka). */
+    double phi(double now, double expected, double pause = 0) const {
+        double mean = expected;
+        double var = 0;
+        if (!intervals.empty())
+        {
+            mean = 0;
+            for (auto t: intervals) mean += t;
+            mean /= intervals.size();
+            for (auto t: intervals) var += (t - mean) * (t - mean);
+            var /= intervals.size();
+        }
+        mean += pause;
+        double std = std::max(std::sqrt(var), expected / 4);
+        /* logistic approximation of the normal CDF */
+        double y = (now - last - mean) / std;
+        double e = std::exp(-y * (1.5976 + 0.070566 * y * y));
+        if (now - last > mean)
+            return -std::log10(e / (1 + e));
+        return -std::log10(1 - 1 / (1 + e));
+    }
+};
+
+/** Log-linear histogram of non-negative integers (in the style of
+ * HdrHistogram): every value is kept with `sub_bits` significant bits, so
+ * the relative error is below 2^-(sub_bits - 1) over the whole range. */
+class LatencyHistogram {
+    static constexpr uint32_t sub_bits = 8;
+    static constexpr uint64_t sub_count = 1 << sub_bits;
+    static constexpr uint64_t half_count = sub_count >> 1;
+    std::vector<uint64_t> counts;
+    uint64_t total;
+    uint64_t max_value;
+    double sum;
+
+    friend class AtomicLatencyHistogram;
+
+    public:
+    static size_t index_of(uint64_t v) {
+        if (v < sub_count) return v;
+        uint32_t shift = 63 - __builtin_clzll(v) - sub_bits + 1;
+        return sub_count + (shift - 1) * half_count + ((v >> shift) - half_count);
+    }
+
+    /* the largest value that falls into the same bucket as index `i` */
+    static uint64_t value_of(size_t i) {
+        if (i < sub_count) return i;
+        uint32_t shift = (i - sub_count) / half_count + 1;
+        uint64_t sub = (i - sub_count) % half_count + half_count;
+        return ((sub + 1) << shift) - 1;
+    }
+
+    LatencyHistogram(): total(0), max_value(0), sum(0) {}
+
+    void record(uint64_t v, uint64_t n = 1) {
+        size_t i = index_of(v);
+        if (i >= counts.size()) counts.resize(i + 1, 0);
+        counts[i] += n;
+        total += n;
+        max_value = std::max(max_value, v);
+        sum += (double)v * n;
+    }
+
+    void merge(const LatencyHistogram &other) {
+        if (other.counts.size() > counts.size())
+            counts.resize(other.counts.size(), 0);
+        for (size_t i = 0; i < other.counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        max_value = std::max(max_value, other.max_value);
+        sum += other.sum;
+    }
+
+    uint64_t get_count() const { return total; }
+    uint64_t get_max() const { return max_value; }
+    double get_mean() const { return total ? sum / total : 0; }
+
+    /** The p-th (0 <= p <= 1) percentile, rounded up to its bucket. */
+    uint64_t get_percentile(double p) const {
+        uint64_t rank = std::max((uint64_t)1, (uint64_t)std::ceil(p * total));
+        uint64_t acc = 0;
+        for (size_t i = 0; i < counts.size(); i++)
+            if ((acc += counts[i]) >= rank)
+                return std::min(value_of(i), max_value);
+        return max_value;
+    }
+};
+
+/** LatencyHistogram that many threads can record into without locking;
+ * its range is fixed (larger values are counted in the last bucket). */
+class AtomicLatencyHistogram {
+    static constexpr uint64_t max_trackable = (1ull << 40) - 1;
+    std::vector<std::atomic<uint64_t>> counts;
+    std::atomic<uint64_t> total;
+    std::atomic<uint64_t> max_value;
+    std::atomic<uint64_t> sum;
+
+    public:
+    AtomicLatencyHistogram():
+        counts(LatencyHistogram::index_of(max_trackable) + 1),
+        total(0), max_value(0), sum(0) {}
+
+    void record(uint64_t v) {
+        counts[LatencyHistogram::index_of(std::min(v, max_trackable))]
+            .fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        sum.fetch_add(v, std::memory_order_relaxed);
+        uint64_t m = max_value.load(std::memory_order_relaxed);
+        while (v > m && !max_value.compare_exchange_weak(
+                    m, v, std::memory_order_relaxed));
+    }
+
+    /** A copy of the counts (consistent once the writers are done). */
+    LatencyHistogram snapshot() const {
+        LatencyHistogram h;
+        h.counts.resize(counts.size());
+        for (size_t i = 0; i < counts.size(); i++)
+            h.counts[i] = counts[i].load(std::memory_order_relaxed);
+        h.total = total.load(std::memory_order_relaxed);
+        h.max_value = max_value.load(std::memory_order_relaxed);
+        h.sum = sum.load(std::memory_order_relaxed);
+        return h;
+    }
+};
+
 #ifdef HOTSTUFF_BLK_PROFILE
 class BlockProfiler {
     enum BlockState {
@@ -1,35 +1,16 @@
 import sys
 import re
 import argparse
-import numpy as np
-from datetime import datetime, timedelta
-
-def remove_outliers(x, outlierConstant = 1.5):
-    a = np.array(x)
-    upper_quartile = np.percentile(a, 75)
-    lower_quartile = np.percentile(a, 25)
-    IQR = (upper_quartile - lower_quartile) * outlierConstant
-    quartileSet = (lower_quartile - IQR, upper_quartile + IQR)
-    resultList = []
-    removedList = []
-    for y in a.tolist():
-        if y >= quartileSet[0] and y <= quartileSet[1]:
-            resultList.append(y)
-        else:
-            removedList.append(y)
-    return (resultList, removedList)
-
-def str2datetime(s):
-    parts = s.split('.')
-    dt = datetime.strptime(parts[0], "%Y-%m-%d %H:%M:%S")
-    return dt.replace(microsecond=int(parts[1]))
 
+# parses the report printed by hotstuff-client on exit; reports from several
+# client processes may be concatenated on stdin, and their per-second counts
+# are lined up by the start time in each report
 
 def plot_thr(fname):
     import matplotlib.pyplot as plt
-    x = range(len(values))
+    x = [i * interval for i in range(len(values))]
     y = values
-    plt.xlabel(r"time")
+    plt.xlabel(r"time (sec)")
     plt.ylabel(r"tx/sec")
     plt.plot(x, y)
     plt.show()
@@ -41,33 +22,67 @@ if __name__ == '__main__':
     parser.add_argument('--output', type=str, default="hist.png", required=False)
     parser.add_argument('--plot', action='store_true')
     args = parser.parse_args()
-    commit_pat = re.compile('([^[].*) \[hotstuff info\] ([0-9.]*)$')
+    lat_pat = re.compile(r'^latency \(us\): count ([0-9]+), outstanding ([0-9]+), '
+                         r'mean ([0-9.]+), max ([0-9]+)$')
+    pct_pat = re.compile(r'^ *([0-9.]+)% +([0-9]+)$')
+    start_pat = re.compile(r'^throughput \(cmds/sec\) since ([0-9.]+):$')
+    thr_pat = re.compile(r'^ *([0-9]+) +([0-9]+)$')
     interval = args.interval
-    begin_time = None
-    next_begin_time = None
-    cnt = 0
-    lats = []
-    timestamps = []
-    values = []
+    nreport = 0
+    count = 0
+    outstanding = 0
+    lat_sum = 0
+    lat_max = 0
+    pcts = {}
+    # (start time, {second: count}) of each report
+    thrs = []
     for line in sys.stdin:
-        m = commit_pat.match(line)
+        line = line.rstrip('\n')
+        m = lat_pat.match(line)
+        if m:
+            nreport += 1
+            n = int(m.group(1))
+            count += n
+            outstanding += int(m.group(2))
+            lat_sum += float(m.group(3)) * n
+            lat_max = max(lat_max, int(m.group(4)))
+            continue
+        m = pct_pat.match(line)
+        if m:
+            pcts.setdefault(m.group(1), []).append(int(m.group(2)))
+            continue
+        m = start_pat.match(line)
         if m:
-            timestamps.append(str2datetime(m.group(1)))
-            lats.append(float(m.group(2)))
-    timestamps.sort()
-    for timestamp in timestamps:
-        if begin_time and timestamp < next_begin_time:
-            cnt += 1
-        else:
-            if begin_time:
-                values.append(cnt)
-            begin_time = timestamp
-            next_begin_time = begin_time + timedelta(seconds=interval)
-            cnt = 1
-    values.append(cnt)
+            thrs.append((float(m.group(1)), {}))
+            continue
+        m = thr_pat.match(line)
+        if m and thrs:
+            thrs[-1][1][int(m.group(1))] = int(m.group(2))
+    if nreport == 0:
+        sys.exit("no client report found")
+    # spread each one-second count over the bins it overlaps
+    t0 = min(t for t, _ in thrs) if thrs else 0
+    bins = {}
+    for t, thr in thrs:
+        for sec, cnt in thr.items():
+            lo = t - t0 + sec
+            hi = lo + 1
+            b = int(lo // interval)
+            while b * interval < hi:
+                overlap = min(hi, (b + 1) * interval) - max(lo, b * interval)
+                bins[b] = bins.get(b, 0) + cnt * overlap
+                b += 1
+    nbin = max(bins.keys()) + 1 if bins else 0
+    values = [bins.get(b, 0) / interval for b in range(nbin)]
     print(values)
-    print("lat = {:.3f}ms".format(sum(lats) / len(lats) * 1e3))
-    lats, _ = remove_outliers(lats)
-    print("lat = {:.3f}ms".format(sum(lats) / len(lats) * 1e3))
+    print("{} report(s), {} request(s), {} outstanding at exit".format(
+        nreport, count, outstanding))
+    if count:
+        print("lat = {:.3f}ms (mean), {:.3f}ms (max)".format(
+            lat_sum / count * 1e-3, lat_max * 1e-3))
+    # percentiles do not merge across processes; show the worst one
+    for p, v in pcts.items():
+        print("p{} = {:.3f}ms{}".format(
+            p, max(v) * 1e-3, " (worst of {})".format(len(v)) if len(v) > 1 else ""))
     if args.plot:
         plot_thr(args.output)
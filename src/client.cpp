@@ -20,6 +20,8 @@ namespace hotstuff {
 
 const opcode_t MsgReqCmd::opcode;
 const opcode_t MsgRespCmd::opcode;
+const opcode_t MsgReqCmdBatch::opcode;
+const opcode_t MsgRespCmdBatch::opcode;
 //#ifdef HOTSTUFF_AUTOCLI
 //const opcode_t MsgDemandCmd::opcode;
 //#endif
@@ -38,7 +38,9 @@ HotStuffCore::HotStuffCore(ReplicaID id,
         vheight(0),
         priv_key(std::move(priv_key)),
         tails{b0},
+        max_ntails(1),
         vote_disabled(false),
+        self_vote_forwarded(false),
         id(id),
         storage(new EntityStorage()) {
     storage->add_blk(b0);
@@ -77,6 +79,7 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
 
     for (auto pblk: blk->parents) tails.erase(pblk);
     tails.insert(blk);
+    max_ntails = std::max(max_ntails, tails.size());
 
     blk->delivered = true;
     LOG_DEBUG("deliver %s", std::string(*blk).c_str());
@@ -147,6 +150,7 @@ void HotStuffCore::update(const block_t &nblk) {
         for (size_t i = 0; i < blk->cmds.size(); i++)
             do_decide(Finality(id, 1, i, blk->height,
                                 blk->cmds[i], blk->get_hash()));
+        do_decide_blk(blk);
     }
     b_exec = blk;
 }
@@ -178,15 +182,50 @@ block_t HotStuffCore::on_propose(const std::vector<uint256_t> &cmds,
     /*if (bnew->height <= vheight)
         throw std::runtime_error("new block should be higher than vheight");*/
     vheight = bnew->height;
-    on_receive_vote(
-        Vote(id, bnew->get_hash(),
-            create_part_cert(*priv_key, bnew_hash), this));
+    async_create_part_cert(*priv_key, bnew_hash).then([this, bnew](PartCert *pc) {
+        if (pc == nullptr)
+        {
+            LOG_WARN("failed to sign the self-vote for %s", get_hex10(bnew->get_hash()).c_str());
+            return;
+        }
+        Vote vote(id, bnew->get_hash(), pc, this);
+        if (self_vote_forwarded)
+            do_vote(id, vote);
+        else
+            on_receive_vote(vote);
+    });
     on_propose_(prop);
     /* boradcast to other replicas */
     LOG_INFO("send %s",std::string(prop).c_str());
     do_broadcast_proposal(prop);
     return bnew;
 }
+void HotStuffCore::flush_qc(const block_t &blk) {
+    if (blk->voted.size() < config.nmajority || blk->self_qc == nullptr)
+        throw std::runtime_error("flushing a block without QC");
+    LOG_PROTO("flush QC for %s", std::string(*blk).c_str());
+    on_receive_flush_qc(blk, blk->self_qc->clone());
+    do_broadcast_flush_qc(blk->get_hash(), *blk->self_qc);
+}
+
+void HotStuffCore::on_receive_flush_qc(const block_t &blk, quorum_cert_bt &&qc) {
+    sanity_check_delivered(blk);
+    const uint256_t &obj_hash = blk->get_cmds().size() ?
+                                blk->get_cmds()[0] : blk->get_hash();
+    if (qc->get_obj_hash() != obj_hash)
+    {
+        LOG_WARN("flushed QC does not match %s", get_hex10(blk->get_hash()).c_str());
+        return;
+    }
+    /* stands for the (empty) block that would have carried the QC; it is
+     * neither stored nor voted for */
+    block_t nblk = new Block(std::vector<block_t>{blk}, std::vector<uint256_t>{},
+                            std::move(qc), bytearray_t(),
+                            blk->height + 1, blk, nullptr);
+    update(nblk);
+    on_qc_finish(blk);
+}
+
 bool HotStuffCore::check_cmds(std::vector<uint256_t> cmds){
     uint8_t milestone_sendbuf[162];
     for(int i = 0; i < cmds.size(); i++){
@@ -265,16 +304,20 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
         Coo::send_data(send_port_for_coo, vote_sendbuf, 1);    
     }
     if (opinion && !vote_disabled){
+        auto emit_vote = [this, bnew, proposer=prop.proposer](PartCert *pc) {
+            if (pc == nullptr)
+            {
+                LOG_WARN("failed to sign the vote for %s", get_hex10(bnew->get_hash()).c_str());
+                return;
+            }
+            do_vote(proposer, Vote(id, bnew->get_hash(), pc, this));
+        };
         if(bnew->get_cmds().size()){
             if(check_cmds(bnew->get_cmds())){
-                do_vote(prop.proposer,
-                    Vote(id, bnew->get_hash(),
-                        create_part_cert(*priv_key, bnew->get_cmds()[0]), this));
+                async_create_part_cert(*priv_key, bnew->get_cmds()[0]).then(emit_vote);
             }
         }else{
-            do_vote(prop.proposer,
-                Vote(id, bnew->get_hash(),
-                    create_part_cert(*priv_key, bnew->get_hash()), this));
+            async_create_part_cert(*priv_key, bnew->get_hash()).then(emit_vote);
         }
         
     }
@@ -306,7 +349,7 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
         /*
         * send back to Coordinator
         * i:int idx
-        * qc->sigs[i]->data: uint8_t[64] signeture
+        * qc->get_part_der(i, ...): DER signature of replica i
         * query decision_waiting_with_none_client
         */
         if(decision_waiting_with_none_client.size()&&blk->get_cmds().size()){
@@ -320,14 +363,15 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
                     sendbuf[i] = std::vector<uint8_t>(qc->get_obj_hash())[i];
                 }
                 int itr = 32;
-                for (size_t i = 0; i < qc->get_rids().size(); i++){
-                    if (qc->get_rids().get(i)){
+                const auto &rids = qc->get_rids();
+                for (size_t i = 0; i < rids.size(); i++){
+                    if (rids.get(i)){
                         uint8_t buff[100];
-                        size_t len;
+                        size_t len = sizeof(buff);
+                        if (!qc->get_part_der(i, buff, len)) continue;
                         sendbuf[itr] = (uint8_t)i;
                         itr ++;
                         LOG_INFO("now return id: %u\n", (uint8_t)i);
-                        qc->sigs[i].serialize(buff,len);
                         sendbuf[itr] = (uint8_t)len;
                         itr ++;
                         memcpy(sendbuf + itr, buff, (uint8_t)len);
@@ -24,43 +24,57 @@ secp256k1_context_t secp256k1_default_verify_ctx = new Secp256k1Context(false);
 
 QuorumCertSecp256k1::QuorumCertSecp256k1(
         const ReplicaConfig &config, const uint256_t &obj_hash):
-            QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas) {
+            QuorumCert(), obj_hash(obj_hash), digest(to_digest(obj_hash)),
+            rids(config.nreplicas),
+            sigs(config.nreplicas) {
     rids.clear();
 }
-   
+
 bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
-    if (sigs.size() < config.nmajority) return false;
+    if (rids.size() != config.nreplicas ||
+        get_nparts() < config.nmajority) return false;
+    secp256k1_ecdsa_signature sig;
     for (size_t i = 0; i < rids.size(); i++)
         if (rids.get(i))
         {
             HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
                                 i, get_hex10(obj_hash).c_str());
-            if (!sigs[i].verify(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            secp256k1_default_verify_ctx))
-            return false;
+            const auto &pubkey = static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i));
+            if (!parse_part(i, sig) ||
+                secp256k1_ecdsa_verify(get_ctx(), &sig,
+                    digest.data(), &pubkey.data) != 1)
+                return false;
         }
     return true;
 }
 
 promise_t QuorumCertSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpool) {
-    if (sigs.size() < config.nmajority)
+    /* check everything that can fail before the first task is added, so
+     * that nothing is left in the pool's batch */
+    if (rids.size() != config.nreplicas ||
+        get_nparts() < config.nmajority)
         return promise_t([](promise_t &pm) { pm.resolve(false); });
-    std::vector<promise_t> vpm;
-    for (size_t i = 0; i < rids.size(); i++)
-        if (rids.get(i))
-        {
-            HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
-                                i, get_hex10(obj_hash).c_str());
-            vpm.push_back(vpool.verify(new Secp256k1VeriTask(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            sigs[i])));
-        }
-    return promise::all(vpm).then([](const promise::values_t &values) {
-        for (const auto &v: values)
-            if (!promise::any_cast<bool>(v)) return false;
-        return true;
-    });
+    secp256k1_ecdsa_signature sig;
+    try {
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i))
+            {
+                HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
+                                    i, get_hex10(obj_hash).c_str());
+                if (!parse_part(i, sig))
+                {
+                    vpool.batch_cancel();
+                    return promise_t([](promise_t &pm) { pm.resolve(false); });
+                }
+                vpool.batch_add<Secp256k1VeriTask>(digest,
+                                static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
+                                sig);
+            }
+    } catch (...) {
+        vpool.batch_cancel();
+        throw;
+    }
+    return vpool.batch_submit();
 }
 
 }
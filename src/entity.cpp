@@ -14,6 +14,8 @@
  * limitations under the License.
  */
 
+#include <cstring>
+
 #include "hotstuff/entity.h"
 #include "hotstuff/hotstuff.h"
 
@@ -33,23 +35,48 @@ void Block::serialize(DataStream &s) const {
     s << htole((uint32_t)extra.size()) << extra;
 }
 
-void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
+/* take n hashes from the stream at once (also bounding n by the data
+ * actually received before allocating) */
+static void load_hashes(DataStream &s, std::vector<uint256_t> &hashes) {
     uint32_t n;
-    uint8_t flag;
-    s >> n;
-    n = letoh(n);
-    parent_hashes.resize(n);
-    for (auto &hash: parent_hashes)
-        s >> hash;
     s >> n;
     n = letoh(n);
-    cmds.resize(n);
-    for (auto &cmd: cmds)
-        s >> cmd;
+    auto base = s.get_data_inplace((size_t)n * 32);
+    hashes.resize(n);
+    for (auto &h: hashes)
+    {
+        h.load(base);
+        base += 32;
+    }
+}
+
+void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
+    uint32_t n;
+    uint8_t flag;
+    /* the block is hashed over the bytes it was parsed from, which are
+     * identical to its serialized form, instead of serializing it again */
+    const uint8_t *begin = s.data();
+    size_t avail = s.size();
+    load_hashes(s, parent_hashes);
+    load_hashes(s, cmds);
 //    for (auto &cmd: cmds)
 //        cmd = hsc->parse_cmd(s);
+    /* ...so every field has to be in the one form serialize() writes */
     s >> flag;
-    qc = flag ? hsc->parse_quorum_cert(s) : nullptr;
+    if (flag > 1)
+        throw std::invalid_argument("ill-formed block: bad qc flag");
+    qc = nullptr;
+    if (flag)
+    {
+        const uint8_t *qc_begin = s.data();
+        size_t qc_avail = s.size();
+        qc = hsc->parse_quorum_cert(s);
+        DataStream qs;
+        qs << *qc;
+        if (qs.size() != qc_avail - s.size() ||
+            memcmp(qs.data(), qc_begin, qs.size()))
+            throw std::invalid_argument("ill-formed block: non-canonical qc");
+    }
     s >> n;
     n = letoh(n);
     if (n == 0)
@@ -59,7 +86,152 @@ void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
         auto base = s.get_data_inplace(n);
         extra = bytearray_t(base, base + n);
     }
-    this->hash = salticidae::get_hash(*this);
+    salticidae::SHA256 sha256;
+    sha256.update(begin, avail - s.size());
+    this->hash = uint256_t(sha256.digest());
+}
+
+static void put_varint(DataStream &s, uint64_t x) {
+    uint8_t buff[10];
+    size_t n = 0;
+    do {
+        uint8_t b = x & 0x7f;
+        x >>= 7;
+        buff[n++] = b | (x ? 0x80 : 0);
+    } while (x);
+    s.put_data(buff, buff + n);
+}
+
+static uint64_t get_varint(DataStream &s) {
+    uint64_t x = 0;
+    for (int shift = 0; shift < 64; shift += 7)
+    {
+        uint8_t b = *s.get_data_inplace(1);
+        x |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80)) return x;
+    }
+    throw std::invalid_argument("ill-formed varint");
+}
+
+/* tags for parent hashes and QCs in a chain segment */
+enum {
+    SEG_FULL = 0,
+    SEG_REF = 1,
+    SEG_NONE = 2
+};
+
+void ChainSegment::serialize(DataStream &s, const std::vector<block_t> &blks) {
+    std::unordered_map<uint256_t, size_t> idx;
+    std::vector<bytearray_t> qcs;
+    put_varint(s, blks.size());
+    for (size_t i = 0; i < blks.size(); i++)
+    {
+        const auto &blk = blks[i];
+        put_varint(s, blk->parent_hashes.size());
+        for (const auto &h: blk->parent_hashes)
+        {
+            auto it = idx.find(h);
+            if (it != idx.end())
+            {
+                s << (uint8_t)SEG_REF;
+                put_varint(s, it->second);
+            }
+            else
+                s << (uint8_t)SEG_FULL << h;
+        }
+        put_varint(s, blk->cmds.size());
+        for (const auto &h: blk->cmds)
+            s << h;
+        if (!blk->qc)
+            s << (uint8_t)SEG_NONE;
+        else
+        {
+            DataStream qs;
+            qs << *blk->qc;
+            bytearray_t qc(qs.data(), qs.data() + qs.size());
+            auto it = std::find(qcs.begin(), qcs.end(), qc);
+            if (it != qcs.end())
+            {
+                s << (uint8_t)SEG_REF;
+                put_varint(s, it - qcs.begin());
+            }
+            else
+            {
+                s << (uint8_t)SEG_FULL;
+                put_varint(s, qc.size());
+                s.put_data(qc.data(), qc.data() + qc.size());
+                qcs.push_back(std::move(qc));
+            }
+        }
+        put_varint(s, blk->extra.size());
+        s.put_data(blk->extra.data(), blk->extra.data() + blk->extra.size());
+        idx.insert(std::make_pair(blk->get_hash(), i));
+    }
+}
+
+std::vector<block_t> ChainSegment::unserialize(DataStream &s, HotStuffCore *hsc) {
+    static const auto _exc = std::invalid_argument("ill-formed chain segment");
+    std::vector<block_t> blks;
+    /* QCs in the order they first appear */
+    std::vector<QuorumCert *> qcs;
+    uint64_t nblks = get_varint(s);
+    if (nblks > s.size()) throw _exc;
+    for (uint64_t i = 0; i < nblks; i++)
+    {
+        block_t blk = new Block();
+        uint64_t n = get_varint(s);
+        if (n > s.size()) throw _exc;
+        blk->parent_hashes.resize(n);
+        for (auto &h: blk->parent_hashes)
+        {
+            uint8_t tag;
+            s >> tag;
+            if (tag == SEG_FULL)
+                s >> h;
+            else if (tag == SEG_REF)
+            {
+                uint64_t ref = get_varint(s);
+                if (ref >= blks.size()) throw _exc;
+                h = blks[ref]->get_hash();
+            }
+            else throw _exc;
+        }
+        n = get_varint(s);
+        /* bound every count by the data left before allocating */
+        if (n > s.size() / 32) throw _exc;
+        auto base = s.get_data_inplace(n * 32);
+        blk->cmds.resize(n);
+        for (auto &h: blk->cmds)
+        {
+            h.load(base);
+            base += 32;
+        }
+        uint8_t tag;
+        s >> tag;
+        if (tag == SEG_FULL)
+        {
+            n = get_varint(s);
+            if (n > s.size()) throw _exc;
+            base = s.get_data_inplace(n);
+            DataStream qs(base, base + n);
+            blk->qc = hsc->parse_quorum_cert(qs);
+            qcs.push_back(blk->qc.get());
+        }
+        else if (tag == SEG_REF)
+        {
+            uint64_t ref = get_varint(s);
+            if (ref >= qcs.size()) throw _exc;
+            blk->qc = qcs[ref]->clone();
+        }
+        else if (tag != SEG_NONE) throw _exc;
+        n = get_varint(s);
+        if (n > s.size()) throw _exc;
+        base = s.get_data_inplace(n);
+        blk->extra = bytearray_t(base, base + n);
+        blk->hash = salticidae::get_hash(*blk);
+        blks.push_back(std::move(blk));
+    }
+    return blks;
 }
 
 bool Block::verify(const HotStuffCore *hsc) const {
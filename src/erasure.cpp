@@ -0,0 +1,172 @@
+#include <stdexcept>
+#include <cstring>
+
+#include "salticidae/crypto.h"
+#include "hotstuff/erasure.h"
+
+namespace hotstuff {
+
+namespace {
+
+/** arithmetic in GF(2^8) with the primitive polynomial x^8+x^4+x^3+x^2+1 */
+struct GF256 {
+    uint8_t exp[512];
+    uint8_t log[256];
+
+    GF256() {
+        unsigned x = 1;
+        for (int i = 0; i < 255; i++)
+        {
+            exp[i] = x;
+            log[x] = i;
+            x <<= 1;
+            if (x & 0x100) x ^= 0x11d;
+        }
+        for (int i = 255; i < 512; i++)
+            exp[i] = exp[i - 255];
+        log[0] = 0;
+    }
+
+    uint8_t mul(uint8_t a, uint8_t b) const {
+        return (a && b) ? exp[log[a] + log[b]] : 0;
+    }
+
+    uint8_t inv(uint8_t a) const { return exp[255 - log[a]]; }
+
+    uint8_t pow(uint8_t a, size_t e) const {
+        if (e == 0) return 1;
+        return a ? exp[(log[a] * e) % 255] : 0;
+    }
+
+    /** dst += c * src */
+    void mul_add(uint8_t *dst, const uint8_t *src, uint8_t c, size_t len) const {
+        if (!c) return;
+        unsigned lc = log[c];
+        for (size_t i = 0; i < len; i++)
+            if (src[i]) dst[i] ^= exp[log[src[i]] + lc];
+    }
+};
+
+const GF256 gf;
+
+uint256_t hash_pair(const uint256_t &a, const uint256_t &b) {
+    salticidae::SHA256 h;
+    h.update(a.to_bytes());
+    h.update(b.to_bytes());
+    return uint256_t(h.digest());
+}
+
+}
+
+ReedSolomon::ReedSolomon(size_t k, size_t n): k(k), n(n) {
+    if (k == 0 || k > n || n > 256)
+        throw std::invalid_argument("invalid Reed-Solomon parameters");
+}
+
+std::vector<bytearray_t> ReedSolomon::encode(const bytearray_t &data) const {
+    /* the payload is prefixed by its length and padded to k shards */
+    size_t len = data.size() + 4;
+    size_t shard_size = (len + k - 1) / k;
+    bytearray_t buff(shard_size * k, 0);
+    uint32_t size = htole((uint32_t)data.size());
+    memmove(&buff[0], &size, 4);
+    if (!data.empty())
+        memmove(&buff[4], &data[0], data.size());
+    std::vector<bytearray_t> chunks(n, bytearray_t(shard_size, 0));
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < k; j++)
+            gf.mul_add(&chunks[i][0], &buff[j * shard_size],
+                        gf.pow(i, j), shard_size);
+    return chunks;
+}
+
+bytearray_t ReedSolomon::decode(const std::vector<std::pair<size_t, bytearray_t>> &chunks) const {
+    static const auto _exc = std::invalid_argument("cannot decode chunks");
+    if (chunks.size() < k) throw _exc;
+    size_t shard_size = chunks[0].second.size();
+    if (shard_size == 0) throw _exc;
+    /* invert the Vandermonde matrix of the first k chunks */
+    std::vector<std::vector<uint8_t>> m(k, std::vector<uint8_t>(2 * k, 0));
+    for (size_t r = 0; r < k; r++)
+    {
+        size_t idx = chunks[r].first;
+        if (idx >= n || chunks[r].second.size() != shard_size) throw _exc;
+        for (size_t j = 0; j < k; j++)
+            m[r][j] = gf.pow(idx, j);
+        m[r][k + r] = 1;
+    }
+    for (size_t c = 0; c < k; c++)
+    {
+        size_t p = c;
+        while (p < k && !m[p][c]) p++;
+        /* duplicate indices */
+        if (p == k) throw _exc;
+        std::swap(m[c], m[p]);
+        uint8_t s = gf.inv(m[c][c]);
+        for (auto &x: m[c]) x = gf.mul(x, s);
+        for (size_t r = 0; r < k; r++)
+            if (r != c && m[r][c])
+                gf.mul_add(&m[r][0], &m[c][0], m[r][c], 2 * k);
+    }
+    bytearray_t buff(shard_size * k, 0);
+    for (size_t j = 0; j < k; j++)
+        for (size_t r = 0; r < k; r++)
+            gf.mul_add(&buff[j * shard_size], &chunks[r].second[0],
+                        m[j][k + r], shard_size);
+    uint32_t size;
+    memmove(&size, &buff[0], 4);
+    size = letoh(size);
+    if ((size_t)size + 4 > buff.size()) throw _exc;
+    return bytearray_t(buff.begin() + 4, buff.begin() + 4 + size);
+}
+
+uint256_t MerkleTree::hash_leaf(const bytearray_t &leaf) {
+    salticidae::SHA256 h;
+    h.update(leaf);
+    return uint256_t(h.digest());
+}
+
+MerkleTree::MerkleTree(const std::vector<bytearray_t> &leaves) {
+    if (leaves.empty())
+        throw std::invalid_argument("empty Merkle tree");
+    levels.emplace_back();
+    for (const auto &l: leaves)
+        levels.back().push_back(hash_leaf(l));
+    while (levels.back().size() > 1)
+    {
+        const auto &cur = levels.back();
+        std::vector<uint256_t> next;
+        for (size_t i = 0; i < cur.size(); i += 2)
+            next.push_back(i + 1 < cur.size() ? hash_pair(cur[i], cur[i + 1]) : cur[i]);
+        levels.push_back(std::move(next));
+    }
+}
+
+std::vector<uint256_t> MerkleTree::get_proof(size_t idx) const {
+    std::vector<uint256_t> proof;
+    for (size_t l = 0; l + 1 < levels.size(); l++, idx >>= 1)
+    {
+        size_t sib = idx ^ 1;
+        if (sib < levels[l].size())
+            proof.push_back(levels[l][sib]);
+    }
+    return proof;
+}
+
+bool MerkleTree::verify(const uint256_t &root, size_t idx, size_t nleaves,
+                        const bytearray_t &leaf,
+                        const std::vector<uint256_t> &proof) {
+    if (idx >= nleaves) return false;
+    uint256_t h = hash_leaf(leaf);
+    size_t p = 0;
+    for (size_t size = nleaves; size > 1; size = (size + 1) >> 1, idx >>= 1)
+    {
+        if ((idx ^ 1) >= size) continue;
+        if (p == proof.size()) return false;
+        h = (idx & 1) ? hash_pair(proof[p], h) : hash_pair(h, proof[p]);
+        p++;
+    }
+    return p == proof.size() && h == root;
+}
+
+}
@@ -56,6 +56,18 @@ MsgReqBlock::MsgReqBlock(DataStream &&s) {
     for (auto &h: blk_hashes) s >> h;
 }
 
+const opcode_t MsgReqBlockRange::opcode;
+MsgReqBlockRange::MsgReqBlockRange(const uint256_t &blk_hash,
+                                    uint32_t nancestors, uint32_t min_height) {
+    serialized << blk_hash << htole(nancestors) << htole(min_height);
+}
+
+MsgReqBlockRange::MsgReqBlockRange(DataStream &&s) {
+    s >> blk_hash >> nancestors >> min_height;
+    nancestors = letoh(nancestors);
+    min_height = letoh(min_height);
+}
+
 const opcode_t MsgRespBlock::opcode;
 MsgRespBlock::MsgRespBlock(const std::vector<block_t> &blks) {
     serialized << htole((uint32_t)blks.size());
@@ -69,12 +81,89 @@ void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
     blks.resize(size);
     for (auto &blk: blks)
     {
-        Block _blk;
-        _blk.unserialize(serialized, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+        block_t _blk = new Block();
+        _blk->unserialize(serialized, hsc);
+        blk = hsc->storage->add_blk(_blk);
+    }
+}
+
+const opcode_t MsgRespBlockSeg::opcode;
+MsgRespBlockSeg::MsgRespBlockSeg(const std::vector<block_t> &blks) {
+    ChainSegment::serialize(serialized, blks);
+}
+
+void MsgRespBlockSeg::postponed_parse(HotStuffCore *hsc) {
+    blks = ChainSegment::unserialize(serialized, hsc);
+    for (auto &blk: blks)
+        blk = hsc->storage->add_blk(blk);
+}
+
+const opcode_t MsgHeartbeat::opcode;
+MsgHeartbeat::MsgHeartbeat(ReplicaID rid) { serialized << rid; }
+MsgHeartbeat::MsgHeartbeat(DataStream &&s) { s >> rid; }
+
+const opcode_t MsgFlushQC::opcode;
+MsgFlushQC::MsgFlushQC(const uint256_t &blk_hash, const QuorumCert &qc) {
+    serialized << blk_hash << qc;
+}
+
+void MsgFlushQC::postponed_parse(HotStuffCore *hsc) {
+    serialized >> blk_hash;
+    qc = hsc->parse_quorum_cert(serialized);
+}
+
+const opcode_t MsgTreeVote::opcode;
+MsgTreeVote::MsgTreeVote(ReplicaID root, const uint256_t &blk_hash,
+                        const std::vector<Vote> &votes) {
+    serialized << root << blk_hash << htole((uint32_t)votes.size());
+    for (const auto &v: votes) serialized << v;
+}
+
+void MsgTreeVote::postponed_parse(HotStuffCore *hsc) {
+    uint32_t size;
+    serialized >> root >> blk_hash >> size;
+    size = letoh(size);
+    /* a subtree holds at most every replica once */
+    if (size > hsc->get_config().nreplicas)
+        throw std::invalid_argument("ill-formed tree vote");
+    votes.resize(size);
+    for (auto &v: votes)
+    {
+        v.hsc = hsc;
+        serialized >> v;
     }
 }
 
+const opcode_t MsgPropChunk::opcode;
+MsgPropChunk::MsgPropChunk(ReplicaID proposer, const uint256_t &root,
+                            uint32_t nchunks, uint32_t idx,
+                            const bytearray_t &chunk,
+                            const std::vector<uint256_t> &proof) {
+    serialized << proposer << root
+                << htole(nchunks) << htole(idx)
+                << htole((uint32_t)chunk.size());
+    serialized.put_data(chunk.data(), chunk.data() + chunk.size());
+    serialized << htole((uint32_t)proof.size());
+    for (const auto &h: proof)
+        serialized << h;
+}
+
+MsgPropChunk::MsgPropChunk(DataStream &&s) {
+    uint32_t size;
+    s >> proposer >> root >> nchunks >> idx >> size;
+    nchunks = letoh(nchunks);
+    idx = letoh(idx);
+    size = letoh(size);
+    auto ptr = s.get_data_inplace(size);
+    chunk = bytearray_t(ptr, ptr + size);
+    s >> size;
+    size = letoh(size);
+    if (size > s.size() / 32)
+        throw std::invalid_argument("ill-formed proposal chunk");
+    proof.resize(size);
+    for (auto &h: proof) s >> h;
+}
+
 // TODO: improve this function
 void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback) {
     cmd_pending.enqueue(std::make_pair(cmd_hash, callback));
@@ -173,8 +262,22 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
         return static_cast<promise_t &>(it->second);
     BlockDeliveryContext pm{[](promise_t){}};
     it = blk_delivery_waiting.insert(std::make_pair(blk_hash, pm)).first;
+    bool fetch_now = true;
+    if (blk_range_limit &&
+        !storage->is_blk_fetched(blk_hash) &&
+        !blk_fetch_waiting.count(blk_hash))
+    {
+        /* ask for the ancestors we are missing along with the block; the
+         * fetch context only retries in case the response is lost */
+        uint32_t min_height = get_highest_tail()->get_height();
+        pn.send_msg(MsgReqBlockRange(blk_hash, blk_range_limit, min_height), replica_id);
+        fetch_now = false;
+    }
     /* otherwise the on_deliver_batch will resolve */
-    async_fetch_blk(blk_hash, &replica_id).then([this, replica_id](block_t blk) {
+    auto pm_fetch = async_fetch_blk(blk_hash, &replica_id, fetch_now);
+    if (!fetch_now)
+        blk_fetch_waiting.find(blk_hash)->second.note_sent(replica_id);
+    pm_fetch.then([this, replica_id](block_t blk) {
         /* qc_ref should be fetched */
         std::vector<promise_t> pms;
         const auto &qc = blk->get_qc();
@@ -198,13 +301,33 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
     return static_cast<promise_t &>(pm);
 }
 
+bool HotStuffBase::is_dup_msg(opcode_t opcode, const DataStream &s, const NetAddr *peer) {
+    salticidae::SHA256 h;
+    h.update(&opcode, sizeof(opcode));
+    if (peer)
+    {
+        h.update((const uint8_t *)&peer->ip, sizeof(peer->ip));
+        h.update((const uint8_t *)&peer->port, sizeof(peer->port));
+    }
+    h.update(s.data(), s.size());
+    if (!dup_filter.check(uint256_t(h.digest()))) return false;
+    part_dup_dropped++;
+    return true;
+}
+
 void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
     const NetAddr &peer = conn->get_peer_addr();
     if (peer.is_null()) return;
+    if (is_dup_msg(MsgPropose::opcode, msg.serialized, &peer)) return;
+    process_proposal(std::move(msg), peer);
+}
+
+void HotStuffBase::process_proposal(MsgPropose &&msg, const NetAddr &peer) {
     msg.postponed_parse(this);
     auto &prop = msg.proposal;
     block_t blk = prop.blk;
     if (!blk) return;
+    if (tree_fanout) tree_on_proposal(prop, peer);
     promise::all(std::vector<promise_t>{
         async_deliver_blk(blk->get_hash(), peer)
     }).then([this, prop = std::move(prop)]() {
@@ -212,12 +335,84 @@ void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
     });
 }
 
+void HotStuffBase::prop_chunk_handler(MsgPropChunk &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    size_t n = get_config().nreplicas;
+    if (msg.proposer >= n || msg.nchunks != n || msg.idx >= n) return;
+    if (!MerkleTree::verify(msg.root, msg.idx, msg.nchunks, msg.chunk, msg.proof))
+    {
+        LOG_WARN("invalid proposal chunk from %s", std::string(peer).c_str());
+        return;
+    }
+    const auto &proposer_addr = get_config().get_addr(msg.proposer);
+    bool from_proposer = peer == proposer_addr;
+    /* the proposer hands each replica the chunk of its own index */
+    if (from_proposer && msg.idx != get_id()) return;
+    auto it = prop_chunks.find(msg.root);
+    if (it == prop_chunks.end())
+    {
+        ec_history.push(msg.root);
+        if (ec_history.size() > ec_history_size)
+        {
+            prop_chunks.erase(ec_history.front());
+            ec_history.pop();
+        }
+        it = prop_chunks.insert(std::make_pair(msg.root, PropChunkSet())).first;
+        auto &cs = it->second;
+        cs.proposer = msg.proposer;
+        cs.have.resize(n, false);
+        cs.decoded = false;
+    }
+    auto &cs = it->second;
+    if (cs.proposer != msg.proposer || cs.have[msg.idx]) return;
+    cs.have[msg.idx] = true;
+    if (from_proposer)
+    {
+        /* echo our chunk to the other replicas */
+        std::vector<NetAddr> others;
+        for (const auto &p: peers)
+            if (p != proposer_addr) others.push_back(p);
+        pn.multicast_msg(MsgPropChunk(msg.proposer, msg.root,
+                                    msg.nchunks, msg.idx,
+                                    msg.chunk, msg.proof), others);
+    }
+    if (cs.decoded) return;
+    cs.chunks.push_back(std::make_pair(msg.idx, std::move(msg.chunk)));
+    size_t k = n - get_config().nmajority + 1;
+    if (cs.chunks.size() < k) return;
+    cs.decoded = true;
+    ReedSolomon rs(k, n);
+    bytearray_t payload;
+    try {
+        payload = rs.decode(cs.chunks);
+    } catch (std::invalid_argument &) {
+        LOG_WARN("cannot decode the proposal from %s", std::string(proposer_addr).c_str());
+        return;
+    }
+    cs.chunks.clear();
+    /* all correct replicas must end up with the same block: re-encode and
+     * check the root */
+    if (MerkleTree(rs.encode(payload)).get_root() != msg.root)
+    {
+        LOG_WARN("inconsistently encoded proposal from %s", std::string(proposer_addr).c_str());
+        return;
+    }
+    process_proposal(MsgPropose(DataStream(std::move(payload))), proposer_addr);
+}
+
 void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
     const NetAddr &peer = conn->get_peer_addr();
     if (peer.is_null()) return;
+    /* a vote carries its voter's signature, so a copy relayed by anyone is
+     * the same vote */
+    if (is_dup_msg(MsgVote::opcode, msg.serialized, nullptr)) return;
     msg.postponed_parse(this);
-    //auto &vote = msg.vote;
-    RcObj<Vote> v(new Vote(std::move(msg.vote)));
+    process_vote(std::move(msg.vote), peer);
+}
+
+void HotStuffBase::process_vote(Vote &&vote, const NetAddr &peer) {
+    RcObj<Vote> v(new Vote(std::move(vote)));
     promise::all(std::vector<promise_t>{
         async_deliver_blk(v->blk_hash, peer),
         v->verify(vpool),
@@ -229,28 +424,337 @@ void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
     });
 }
 
+void HotStuffBase::flush_qc_handler(MsgFlushQC &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    msg.postponed_parse(this);
+    RcObj<QuorumCert> qc(msg.qc.unwrap());
+    const uint256_t blk_hash = msg.blk_hash;
+    promise::all(std::vector<promise_t>{
+        async_deliver_blk(blk_hash, peer),
+        qc->verify(get_config(), vpool),
+    }).then([this, blk_hash, qc=std::move(qc)](const promise::values_t values) {
+        if (!promise::any_cast<bool>(values[1]))
+            LOG_WARN("invalid flushed QC for %s", get_hex10(blk_hash).c_str());
+        else
+            on_receive_flush_qc(storage->find_blk(blk_hash), qc->clone());
+    });
+}
+
+void HotStuffBase::heartbeat_handler(MsgHeartbeat &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null() || msg.rid != hb_proposer) return;
+    if (msg.rid >= get_config().nreplicas || get_config().get_addr(msg.rid) != peer)
+        return;
+    hb_detector.heartbeat(get_mono_time());
+}
+
+void HotStuffBase::on_hb_timer() {
+    ReplicaID proposer = pmaker->get_proposer();
+    double now = get_mono_time();
+    /* tolerate a few lost or delayed heartbeats before suspecting */
+    double pause = 3 * hb_interval;
+    if (proposer == get_id())
+        pn.multicast_msg(MsgHeartbeat(get_id()), peers);
+    else if (proposer != hb_proposer)
+    {
+        hb_proposer = proposer;
+        hb_detector.reset(now);
+    }
+    else if (hb_detector.phi(now, hb_interval, pause) > hb_phi)
+    {
+        LOG_WARN("proposer %d is suspected to have failed, impeach it", proposer);
+        part_impeached++;
+        pmaker->impeach();
+        hb_detector.reset(now);
+    }
+    hb_timer.add(hb_interval);
+}
+
 void HotStuffBase::req_blk_handler(MsgReqBlock &&msg, const Net::conn_t &conn) {
     const NetAddr replica = conn->get_peer_addr();
     if (replica.is_null()) return;
-    auto &blk_hashes = msg.blk_hashes;
-    std::vector<promise_t> pms;
-    for (const auto &h: blk_hashes)
-        pms.push_back(async_fetch_blk(h, nullptr));
-    promise::all(pms).then([replica, this](const promise::values_t values) {
-        std::vector<block_t> blks;
-        for (auto &v: values)
+    for (const auto &h: msg.blk_hashes)
+        async_fetch_blk(h, nullptr).then([this, replica](block_t blk) {
+            queue_resp_blk(blk, replica);
+        });
+}
+
+void HotStuffBase::req_blk_range_handler(MsgReqBlockRange &&msg, const Net::conn_t &conn) {
+    const NetAddr replica = conn->get_peer_addr();
+    if (replica.is_null()) return;
+    uint32_t nancestors = std::min(msg.nancestors, max_blk_range);
+    uint32_t min_height = msg.min_height;
+    async_fetch_blk(msg.blk_hash, nullptr).then(
+            [this, replica, nancestors, min_height](block_t blk) {
+        std::vector<block_t> blks{blk};
+        for (block_t b = blk; blks.size() <= nancestors;)
         {
-            auto blk = promise::any_cast<block_t>(v);
-            blks.push_back(blk);
+            const auto &phashes = b->get_parent_hashes();
+            if (phashes.empty()) break;
+            b = storage->find_blk(phashes[0]);
+            if (!b || !b->is_delivered() || b->get_height() <= min_height)
+                break;
+            blks.push_back(b);
         }
-        pn.send_msg(MsgRespBlock(blks), replica);
+        /* ancestors first */
+        for (auto it = blks.rbegin(); it != blks.rend(); it++)
+            queue_resp_blk(*it, replica);
     });
 }
 
-void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &) {
+void HotStuffBase::queue_req_blk(const uint256_t &blk_hash, const NetAddr &replica) {
+    auto &hashes = req_blk_pending[replica];
+    if (std::find(hashes.begin(), hashes.end(), blk_hash) != hashes.end())
+        return;
+    hashes.push_back(blk_hash);
+    schedule_blk_flush();
+}
+
+void HotStuffBase::queue_resp_blk(const block_t &blk, const NetAddr &replica) {
+    auto &blks = resp_blk_pending[replica];
+    if (std::find(blks.begin(), blks.end(), blk) != blks.end())
+        return;
+    blks.push_back(blk);
+    schedule_blk_flush();
+}
+
+void HotStuffBase::schedule_blk_flush() {
+    if (blk_flush_scheduled) return;
+    blk_flush_scheduled = true;
+    blk_flush_timer.add(blk_flush_window);
+}
+
+void HotStuffBase::flush_blk_msgs() {
+    blk_flush_scheduled = false;
+    for (auto &p: req_blk_pending)
+        if (!p.second.empty())
+        {
+            pn.send_msg(MsgReqBlock(p.second), p.first);
+            p.second.clear();
+        }
+    for (auto &p: resp_blk_pending)
+        if (!p.second.empty())
+        {
+            /* a run of blocks (typically an ancestor range) shares parent
+             * hashes and QCs, which the segment encoding elides */
+            if (p.second.size() > 1)
+                queue_bulk(MsgRespBlockSeg::opcode,
+                        std::move(MsgRespBlockSeg(p.second).serialized), p.first);
+            else
+                queue_bulk(MsgRespBlock::opcode,
+                        std::move(MsgRespBlock(p.second).serialized), p.first);
+            p.second.clear();
+        }
+}
+
+void HotStuffBase::queue_bulk(opcode_t opcode, DataStream &&serialized,
+                                const NetAddr &replica) {
+    BulkMsg msg{opcode, std::move(serialized)};
+    size_t size = msg.serialized.size();
+    if (bulk_rate <= 0)
+    {
+        part_bulk_sent += size;
+        send_bulk(std::move(msg), replica);
+        return;
+    }
+    bulk_queued_msgs++;
+    bulk_queued_bytes += size;
+    auto &q = bulk_queue[replica];
+    if (q.empty()) bulk_ready.push(replica);
+    q.push(std::move(msg));
+    drain_bulk();
+}
+
+void HotStuffBase::send_bulk(BulkMsg &&msg, const NetAddr &replica) {
+    if (msg.opcode == MsgRespBlockSeg::opcode)
+        pn.send_msg(MsgRespBlockSeg(std::move(msg.serialized)), replica);
+    else
+        pn.send_msg(MsgRespBlock(std::move(msg.serialized)), replica);
+}
+
+void HotStuffBase::drain_bulk() {
+    double now = get_mono_time();
+    bulk_tokens = std::min(bulk_rate * bulk_burst,
+                        bulk_tokens + (now - bulk_last_refill) * bulk_rate);
+    bulk_last_refill = now;
+    /* one message per peer in turn, resuming where the last drain stopped;
+     * a message larger than the bucket still goes out, leaving the bucket
+     * in debt */
+    while (!bulk_ready.empty() && bulk_tokens > 0)
+    {
+        NetAddr replica = bulk_ready.front();
+        bulk_ready.pop();
+        auto it = bulk_queue.find(replica);
+        auto &msg = it->second.front();
+        size_t size = msg.serialized.size();
+        bulk_tokens -= size;
+        bulk_queued_msgs--;
+        bulk_queued_bytes -= size;
+        part_bulk_sent += size;
+        send_bulk(std::move(msg), replica);
+        it->second.pop();
+        if (it->second.empty())
+            bulk_queue.erase(it);
+        else
+            bulk_ready.push(replica);
+    }
+    if (bulk_queued_msgs && !bulk_scheduled)
+    {
+        part_bulk_deferred++;
+        bulk_scheduled = true;
+        bulk_timer.add(std::max(0.001, -bulk_tokens / bulk_rate));
+    }
+}
+
+void HotStuffBase::resp_blk_handler(MsgRespBlock &&msg, const Net::conn_t &conn) {
+    msg.postponed_parse(this);
+    on_resp_blks(msg.blks, conn->get_peer_addr());
+}
+
+void HotStuffBase::resp_blk_seg_handler(MsgRespBlockSeg &&msg, const Net::conn_t &conn) {
+    msg.postponed_parse(this);
+    on_resp_blks(msg.blks, conn->get_peer_addr());
+}
+
+void HotStuffBase::on_resp_blks(const std::vector<block_t> &blks, const NetAddr &peer) {
+    for (const auto &blk: blks)
+    {
+        if (!blk) continue;
+        auto it = blk_fetch_waiting.find(blk->get_hash());
+        if (it != blk_fetch_waiting.end())
+            it->second.on_response(peer);
+        on_fetch_blk(blk);
+    }
+}
+
+double HotStuffBase::get_fetch_timeout(const NetAddr &replica) const {
+    auto it = peer_rtt.find(replica);
+    if (it == peer_rtt.end() || it->second.empty())
+        return ent_initial_timeout;
+    return std::max(ent_min_timeout,
+                    std::min(ent_waiting_timeout, it->second.get_rto()));
+}
+
+double HotStuffBase::get_hedge_delay(const NetAddr &replica) const {
+    auto it = peer_rtt.find(replica);
+    if (it == peer_rtt.end() || it->second.empty())
+        return ent_initial_timeout / 2;
+    return std::min(get_fetch_timeout(replica), it->second.get_percentile(0.95));
+}
+
+void HotStuffBase::tree_vote_handler(MsgTreeVote &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
     msg.postponed_parse(this);
-    for (const auto &blk: msg.blks)
-        if (blk) on_fetch_blk(blk);
+    std::vector<Vote> votes;
+    for (auto &v: msg.votes)
+    {
+        if (v.blk_hash == msg.blk_hash)
+            votes.push_back(std::move(v));
+        else
+            LOG_WARN("dropping a vote not for %s from the tree", get_hex10(msg.blk_hash).c_str());
+    }
+    if (msg.root == get_id())
+        for (auto &v: votes) process_vote(std::move(v), peer);
+    else if (tree_fanout)
+        tree_add_votes(msg.root, msg.blk_hash, std::move(votes));
+}
+
+size_t HotStuffBase::tree_subtree_size(size_t pos) const {
+    size_t n = get_config().nreplicas;
+    size_t size = 0;
+    for (size_t lo = pos, hi = pos; lo < n;
+            lo = lo * tree_fanout + 1, hi = hi * tree_fanout + tree_fanout)
+        size += std::min(hi, n - 1) - lo + 1;
+    return size;
+}
+
+std::vector<NetAddr> HotStuffBase::tree_children(ReplicaID root) const {
+    std::vector<NetAddr> children;
+    size_t n = get_config().nreplicas;
+    size_t first = tree_pos(root, get_id()) * tree_fanout + 1;
+    for (size_t p = first; p < first + tree_fanout && p < n; p++)
+        children.push_back(get_config().get_addr(tree_rid(root, p)));
+    return children;
+}
+
+void HotStuffBase::tree_track(const uint256_t &blk_hash) {
+    if (!tree_seen.insert(blk_hash).second) return;
+    tree_history.push(blk_hash);
+    if (tree_history.size() <= tree_history_size) return;
+    const auto &h = tree_history.front();
+    tree_vote_agg.erase(h);
+    tree_relayed.erase(h);
+    tree_star.erase(h);
+    tree_my_votes.erase(h);
+    tree_seen.erase(h);
+    tree_history.pop();
+}
+
+void HotStuffBase::tree_on_proposal(const Proposal &prop, const NetAddr &peer) {
+    const auto &blk_hash = prop.blk->get_hash();
+    ReplicaID root = prop.proposer;
+    size_t pos = tree_pos(root, get_id());
+    if (pos == 0) return;
+    tree_track(blk_hash);
+    const auto &parent = get_config().get_addr(tree_rid(root, (pos - 1) / tree_fanout));
+    if (tree_relayed.insert(blk_hash).second && peer == parent)
+    {
+        auto children = tree_children(root);
+        if (!children.empty())
+            pn.multicast_msg(MsgPropose(prop), children);
+        return;
+    }
+    /* the proposer fell back to star broadcast: vote directly from now on */
+    tree_star.insert(blk_hash);
+    auto it = tree_my_votes.find(blk_hash);
+    if (it != tree_my_votes.end())
+        pn.send_msg(MsgVote(it->second), get_config().get_addr(root));
+}
+
+void HotStuffBase::tree_add_votes(ReplicaID root, const uint256_t &blk_hash,
+                                std::vector<Vote> &&votes) {
+    size_t pos = tree_pos(root, get_id());
+    if (pos == 0) return;
+    auto it = tree_vote_agg.find(blk_hash);
+    if (it == tree_vote_agg.end())
+    {
+        tree_track(blk_hash);
+        it = tree_vote_agg.insert(std::make_pair(blk_hash, TreeVoteAgg())).first;
+        auto &agg = it->second;
+        agg.root = root;
+        agg.expected = tree_subtree_size(pos);
+        agg.flushed = false;
+        agg.timer = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+            tree_flush_votes(blk_hash);
+        });
+        agg.timer.add(tree_agg_timeout);
+    }
+    auto &agg = it->second;
+    if (agg.flushed)
+    {
+        /* late votes go up right away */
+        pn.send_msg(MsgTreeVote(root, blk_hash, votes),
+            get_config().get_addr(tree_rid(root, (pos - 1) / tree_fanout)));
+        return;
+    }
+    for (auto &v: votes) agg.votes.push_back(std::move(v));
+    if (agg.votes.size() >= agg.expected)
+        tree_flush_votes(blk_hash);
+}
+
+void HotStuffBase::tree_flush_votes(const uint256_t &blk_hash) {
+    auto it = tree_vote_agg.find(blk_hash);
+    if (it == tree_vote_agg.end() || it->second.flushed) return;
+    auto &agg = it->second;
+    agg.flushed = true;
+    agg.timer.del();
+    if (agg.votes.empty()) return;
+    size_t pos = tree_pos(agg.root, get_id());
+    pn.send_msg(MsgTreeVote(agg.root, blk_hash, agg.votes),
+        get_config().get_addr(tree_rid(agg.root, (pos - 1) / tree_fanout)));
+    agg.votes.clear();
 }
 
 bool HotStuffBase::conn_handler(const salticidae::ConnPool::conn_t &conn, bool connected) {
@@ -269,16 +773,26 @@ void HotStuffBase::print_stat() const {
     LOG_INFO("blk_fetch_waiting: %lu", blk_fetch_waiting.size());
     LOG_INFO("blk_delivery_waiting: %lu", blk_delivery_waiting.size());
     LOG_INFO("decision_waiting: %lu", decision_waiting_with_none_client.size());
+    LOG_INFO("bulk_queue: %lu (%lu bytes)",
+            bulk_queued_msgs, bulk_queued_bytes);
     LOG_INFO("-------- misc ---------");
+    LOG_INFO("verified: %lu inline, %lu offloaded, %lu outstanding",
+            vpool.get_ninline(), vpool.get_noffload(), vpool.get_noutstanding());
     LOG_INFO("fetched: %lu", fetched);
     LOG_INFO("delivered: %lu", delivered);
     LOG_INFO("cmd_cache: %lu", storage->get_cmd_cache_size());
     LOG_INFO("blk_cache: %lu", storage->get_blk_cache_size());
+    LOG_INFO("tails: %lu, highest at %u, lowest at %u",
+            get_tails().size(), get_highest_tail()->get_height(),
+            (*get_tails().rbegin())->get_height());
     LOG_INFO("------ misc (10s) -----");
     LOG_INFO("fetched: %lu", part_fetched);
     LOG_INFO("delivered: %lu", part_delivered);
     LOG_INFO("decided: %lu", part_decided);
     LOG_INFO("gened: %lu", part_gened);
+    LOG_INFO("bulk sent: %lu bytes, throttled %lu times", part_bulk_sent, part_bulk_deferred);
+    LOG_INFO("impeached: %u", part_impeached);
+    LOG_INFO("max. tails (forks): %lu", reset_max_ntails());
     LOG_INFO("avg. parent_size: %.3f",
             part_delivered ? part_parent_size / double(part_delivered) : 0);
     LOG_INFO("delivery time: %.3f avg, %.3f min, %.3f max",
@@ -291,6 +805,9 @@ void HotStuffBase::print_stat() const {
     part_delivered = 0;
     part_decided = 0;
     part_gened = 0;
+    part_bulk_sent = 0;
+    part_bulk_deferred = 0;
+    part_impeached = 0;
     part_delivery_time = 0;
     part_delivery_time_min = double_inf;
     part_delivery_time_max = 0;
@@ -317,6 +834,8 @@ void HotStuffBase::print_stat() const {
     nrecv += _nrecv;
     LOG_INFO("sent: %lu", _nsent);
     LOG_INFO("recv: %lu", _nrecv);
+    LOG_INFO("dup. dropped: %u", part_dup_dropped);
+    part_dup_dropped = 0;
     LOG_INFO("--- replica msg. total ---");
     LOG_INFO("sent: %lu", nsent);
     LOG_INFO("recv: %lu", nrecv);
@@ -340,6 +859,25 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         vpool(ec, nworker),
         pn(ec, netconfig),
         pmaker(std::move(pmaker)),
+        tree_fanout(0),
+        tree_agg_timeout(0),
+        ec_threshold(0),
+        blk_flush_window(0),
+        blk_flush_scheduled(false),
+        blk_range_limit(0),
+        bulk_rate(0),
+        bulk_tokens(0),
+        bulk_last_refill(get_mono_time()),
+        bulk_scheduled(false),
+        bulk_queued_msgs(0),
+        bulk_queued_bytes(0),
+        part_bulk_sent(0),
+        part_bulk_deferred(0),
+        dup_filter(dup_filter_size),
+        hb_interval(0),
+        hb_phi(8),
+        hb_proposer(0),
+        part_impeached(0),
 
         fetched(0), delivered(0),
         nsent(0), nrecv(0),
@@ -348,21 +886,73 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         part_delivered(0),
         part_decided(0),
         part_gened(0),
+        part_dup_dropped(0),
         part_delivery_time(0),
         part_delivery_time_min(double_inf),
         part_delivery_time_max(0)
 {
+    blk_flush_timer = TimerEvent(ec, [this](TimerEvent &) { flush_blk_msgs(); });
+    hb_timer = TimerEvent(ec, [this](TimerEvent &) { on_hb_timer(); });
+    bulk_timer = TimerEvent(ec, [this](TimerEvent &) {
+        bulk_scheduled = false;
+        drain_bulk();
+    });
     /* register the handlers for msg from replicas */
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_range_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_seg_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::tree_vote_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::flush_qc_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::heartbeat_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::prop_chunk_handler, this, _1, _2));
     pn.reg_conn_handler(salticidae::generic_bind(&HotStuffBase::conn_handler, this, _1, _2));
     pn.start();
     pn.listen(listen_addr);
 }
 
 void HotStuffBase::do_broadcast_proposal(const Proposal &prop) {
+    if (tree_fanout)
+    {
+        auto children = tree_children(get_id());
+        if (!children.empty())
+            pn.multicast_msg(MsgPropose(prop), children);
+        return;
+    }
+    if (ec_threshold)
+    {
+        MsgPropose msg(prop);
+        if (msg.serialized.size() >= ec_threshold)
+        {
+            broadcast_proposal_chunks(msg.serialized);
+            return;
+        }
+    }
+    broadcast_proposal_star(prop);
+}
+
+void HotStuffBase::do_broadcast_flush_qc(const uint256_t &blk_hash, const QuorumCert &qc) {
+    pn.multicast_msg(MsgFlushQC(blk_hash, qc), peers);
+}
+
+void HotStuffBase::broadcast_proposal_chunks(const DataStream &serialized) {
+    size_t n = get_config().nreplicas;
+    ReedSolomon rs(n - get_config().nmajority + 1, n);
+    auto chunks = rs.encode(bytearray_t(serialized.data(),
+                                        serialized.data() + serialized.size()));
+    MerkleTree mt(chunks);
+    for (size_t i = 0; i < n; i++)
+    {
+        if (i == get_id()) continue;
+        pn.send_msg(MsgPropChunk(get_id(), mt.get_root(), n, i,
+                                chunks[i], mt.get_proof(i)),
+                    get_config().get_addr(i));
+    }
+}
+
+void HotStuffBase::broadcast_proposal_star(const Proposal &prop) {
     //MsgPropose prop_msg(prop);
     pn.multicast_msg(MsgPropose(prop), peers);
     //for (const auto &replica: peers)
@@ -372,10 +962,14 @@ void HotStuffBase::do_broadcast_proposal(const Proposal &prop) {
 void HotStuffBase::do_vote(ReplicaID last_proposer, const Vote &vote) {
     pmaker->beat_resp(last_proposer)
             .then([this, vote](ReplicaID proposer) {
+        /* with rotating proposers, we may be the next one */
         if (proposer == get_id())
+            on_receive_vote(vote);
+        else if (tree_fanout && !tree_star.count(vote.blk_hash))
         {
-            throw HotStuffError("unreachable line");
-            //on_receive_vote(vote);
+            tree_track(vote.blk_hash);
+            tree_my_votes.insert(std::make_pair(vote.blk_hash, vote));
+            tree_add_votes(proposer, vote.blk_hash, std::vector<Vote>{vote});
         }
         else
             pn.send_msg(MsgVote(vote), get_config().get_addr(proposer));
@@ -423,6 +1017,17 @@ void HotStuffBase::start(
         LOG_WARN("too few replicas in the system to tolerate any failure");
     on_init(nfaulty);
     pmaker->init(this);
+    if (hb_interval > 0 && !pmaker->can_impeach())
+    {
+        LOG_WARN("the pace maker cannot impeach a proposer, heartbeats disabled");
+        hb_interval = 0;
+    }
+    if (hb_interval > 0)
+    {
+        hb_proposer = pmaker->get_proposer();
+        hb_detector.reset(get_mono_time());
+        hb_timer.add(hb_interval);
+    }
     if (ec_loop)
         ec.dispatch();
 
@@ -0,0 +1,163 @@
+/* Throughput/latency benchmark of the crypto stack.
+ *
+ * usage: bench_crypto [iterations] [max_nworker]
+ *
+ * Prints one CSV row per (operation, n, nworker):
+ *   op,n,nworker,iters,ops_per_sec,p50_us,p99_us
+ * where nworker is 0 for operations run serially on the calling thread. */
+
+#include <chrono>
+#include <algorithm>
+#include <functional>
+#include <thread>
+
+#include "hotstuff/entity.h"
+#include "hotstuff/crypto.h"
+
+using namespace hotstuff;
+using bench_clock = std::chrono::steady_clock;
+
+static double elapsed_us(bench_clock::time_point t0, bench_clock::time_point t1) {
+    return std::chrono::duration<double, std::micro>(t1 - t0).count();
+}
+
+static void report(const char *op, size_t n, size_t nworker,
+                    std::vector<double> &lat, double total_us) {
+    std::sort(lat.begin(), lat.end());
+    auto pct = [&lat](double p) {
+        return lat[std::min(lat.size() - 1, (size_t)(p * lat.size()))];
+    };
+    printf("%s,%lu,%lu,%lu,%.1f,%.2f,%.2f\n",
+            op, n, nworker, lat.size(),
+            lat.size() / total_us * 1e6, pct(0.5), pct(0.99));
+    fflush(stdout);
+}
+
+/* time `iters` serial calls of `f` */
+static void bench_serial(const char *op, size_t n, size_t iters,
+                        const std::function<void()> &f) {
+    std::vector<double> lat;
+    lat.reserve(iters);
+    auto start = bench_clock::now();
+    for (size_t i = 0; i < iters; i++)
+    {
+        auto t0 = bench_clock::now();
+        f();
+        lat.push_back(elapsed_us(t0, bench_clock::now()));
+    }
+    report(op, n, 0, lat, elapsed_us(start, bench_clock::now()));
+}
+
+/* run `iters` asynchronous calls of `f` in waves of `wave` calls, each timed
+ * until its promise resolves; a wave should not exceed the workers, so that
+ * calls do not queue behind earlier ones */
+static void bench_pool(const char *op, size_t n, size_t nworker, size_t wave,
+                        size_t iters,
+                        const std::function<promise_t(VeriPool &)> &f) {
+    EventContext ec;
+    VeriPool vpool(ec, nworker);
+    vpool.set_inline_depth(0);
+    std::vector<double> lat;
+    lat.reserve(iters);
+    size_t nfail = 0;
+    auto start = bench_clock::now();
+    for (size_t i = 0; i < iters;)
+    {
+        size_t wave_end = std::min(iters, i + wave);
+        for (; i < wave_end; i++)
+        {
+            auto t0 = bench_clock::now();
+            f(vpool).then([&, t0, wave_end](bool result) {
+                lat.push_back(elapsed_us(t0, bench_clock::now()));
+                if (!result) nfail++;
+                if (lat.size() == wave_end) ec.stop();
+            });
+        }
+        if (lat.size() < wave_end) ec.dispatch();
+    }
+    if (nfail)
+        throw std::runtime_error(std::string(op) + ": verification failed");
+    report(op, n, nworker, lat, elapsed_us(start, bench_clock::now()));
+}
+
+int main(int argc, char **argv) {
+    size_t iters = argc > 1 ? std::stoul(argv[1]) : 200;
+    size_t max_nworker = argc > 2 ? std::stoul(argv[2]) :
+                        std::max(1u, std::thread::hardware_concurrency());
+
+    printf("op,n,nworker,iters,ops_per_sec,p50_us,p99_us\n");
+    for (size_t n: {4, 16, 64, 128})
+    {
+        ReplicaConfig config;
+        std::vector<PrivKeySecp256k1> privs(n);
+        for (size_t i = 0; i < n; i++)
+        {
+            privs[i].from_rand();
+            config.add_replica(i, ReplicaInfo(i, salticidae::NetAddr(), privs[i].get_pubkey()));
+        }
+        config.nmajority = config.nreplicas - (config.nreplicas - 1) / 3;
+        const size_t nmajority = config.nmajority;
+
+        uint256_t obj_hash = salticidae::get_hash(bytearray_t(32, n));
+        std::vector<BoxObj<PartCertSecp256k1>> parts;
+        for (size_t i = 0; i < nmajority; i++)
+            parts.emplace_back(new PartCertSecp256k1(privs[i], obj_hash));
+
+        /* part certificates */
+        bench_serial("part_create", n, iters, [&]() {
+            PartCertSecp256k1 pc(privs[0], obj_hash);
+        });
+        bench_serial("part_verify", n, iters, [&]() {
+            if (!parts[0]->verify(config.get_pubkey(0)))
+                throw std::runtime_error("part_verify failed");
+        });
+
+        /* quorum certificates */
+        QuorumCertSecp256k1 qc(config, obj_hash);
+        bench_serial("qc_build", n, iters, [&]() {
+            QuorumCertSecp256k1 _qc(config, obj_hash);
+            for (size_t i = 0; i < nmajority; i++)
+                _qc.add_part(i, *parts[i]);
+            _qc.compute();
+        });
+        for (size_t i = 0; i < nmajority; i++)
+            qc.add_part(i, *parts[i]);
+        qc.compute();
+        bench_serial("qc_serialize", n, iters, [&]() {
+            DataStream s;
+            s << qc;
+        });
+        DataStream qc_raw;
+        qc_raw << qc;
+        bench_serial("qc_parse", n, iters, [&]() {
+            DataStream s(qc_raw.data(), qc_raw.data() + qc_raw.size());
+            QuorumCertSecp256k1 _qc(config, uint256_t());
+            s >> _qc;
+        });
+        bench_serial("qc_verify", n, iters, [&]() {
+            if (!qc.verify(config))
+                throw std::runtime_error("qc_verify failed");
+        });
+        for (size_t nworker = 1; nworker <= max_nworker; nworker <<= 1)
+        {
+            bench_pool("part_verify_pool", n, nworker, nworker, iters, [&](VeriPool &vpool) {
+                return parts[0]->verify(config.get_pubkey(0), vpool);
+            });
+            /* a QC spreads its signatures over all workers already */
+            bench_pool("qc_verify_pool", n, nworker, 1, iters, [&](VeriPool &vpool) {
+                return qc.verify(config, vpool);
+            });
+        }
+
+        /* block hash, with the QC embedded */
+        block_t genesis = new Block(true, 1);
+        std::vector<uint256_t> cmds;
+        for (size_t i = 0; i < 6; i++)
+            cmds.push_back(salticidae::get_hash(bytearray_t(32, i)));
+        Block blk({genesis}, cmds, qc.clone(), bytearray_t(), 1, genesis, nullptr);
+        bench_serial("block_hash", n, iters, [&]() {
+            salticidae::get_hash(blk);
+        });
+    }
+    return 0;
+}
@@ -0,0 +1,447 @@
+/* Replays a failure scenario against each pacemaker on a virtual clock.
+ *
+ * usage: sim_pacemaker [scenario]
+ *
+ * The replicas run the unmodified HotStuffCore and pacemakers (with dummy
+ * certificates) over a simulated network. A scenario has one directive per
+ * line ('#' starts a comment):
+ *   replicas <n>               number of replicas
+ *   duration <sec>             simulated time
+ *   latency <sec>              one-way network delay
+ *   load <sec>                 interval between proposal requests
+ *   imp-timeout <sec>          impeach after this long without a commit
+ *   base-timeout <sec>         initial rotation timeout (rr*)
+ *   prop-delay <sec>           delay after a rotation timeout (rr*)
+ *   crash <rid> <from> <to>    cut a replica off the network in [from, to)
+ *   delay <from> <to> <sec>    add to the network delay in [from, to)
+ *
+ * Prints one CSV row per pacemaker, measured on a replica that never crashes:
+ *   pacemaker,commits,baseline,tput_loss,crash_commits,leader_changes,
+ *   impeachments,max_gap,ttr_avg,ttr_max
+ * where baseline is the number of commits without faults, crash_commits the
+ * commits made while some replica is down (0 means no progress without it),
+ * and ttr the time from the onset of each fault to the next commit (-1 if
+ * there is none).
+ *
+ * Blocks carry no commands (in this tree a block with commands is certified
+ * by its first command, which the simulated chain cannot follow), so the QC
+ * flush and rr-block's proposals to commit pending commands are not covered;
+ * the output starts with a comment line saying so. */
+
+#include <fstream>
+#include <sstream>
+#include <queue>
+#include <functional>
+
+#include "hotstuff/liveness.h"
+
+using namespace hotstuff;
+
+struct Scenario {
+    struct Crash { ReplicaID rid; double from, to; };
+    struct Delay { double from, to, extra; };
+    size_t nreplicas = 4;
+    double duration = 30;
+    double latency = 0.001;
+    double load = 0.01;
+    double imp_timeout = 1;
+    double base_timeout = 1;
+    double prop_delay = 1;
+    std::vector<Crash> crashes{{0, 5, 15}};
+    std::vector<Delay> delays{{20, 22, 0.05}};
+
+    bool is_down(ReplicaID rid, double t) const {
+        for (const auto &c: crashes)
+            if (c.rid == rid && c.from <= t && t < c.to) return true;
+        return false;
+    }
+
+    bool is_any_down(double t) const {
+        for (const auto &c: crashes)
+            if (c.from <= t && t < c.to) return true;
+        return false;
+    }
+
+    double get_delay(double t) const {
+        double d = latency;
+        for (const auto &e: delays)
+            if (e.from <= t && t < e.to) d += e.extra;
+        return d;
+    }
+
+    std::vector<double> get_fault_times() const {
+        std::vector<double> ret;
+        for (const auto &c: crashes) ret.push_back(c.from);
+        for (const auto &e: delays) ret.push_back(e.from);
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    }
+
+    void load_file(const char *fname) {
+        std::ifstream f(fname);
+        if (!f) throw std::invalid_argument(std::string("cannot open ") + fname);
+        crashes.clear();
+        delays.clear();
+        std::string line;
+        while (std::getline(f, line))
+        {
+            line = line.substr(0, line.find('#'));
+            std::istringstream ss(line);
+            std::string cmd;
+            if (!(ss >> cmd)) continue;
+            bool ok = true;
+            if (cmd == "replicas") ok = (bool)(ss >> nreplicas);
+            else if (cmd == "duration") ok = (bool)(ss >> duration);
+            else if (cmd == "latency") ok = (bool)(ss >> latency);
+            else if (cmd == "load") ok = (bool)(ss >> load);
+            else if (cmd == "imp-timeout") ok = (bool)(ss >> imp_timeout);
+            else if (cmd == "base-timeout") ok = (bool)(ss >> base_timeout);
+            else if (cmd == "prop-delay") ok = (bool)(ss >> prop_delay);
+            else if (cmd == "crash")
+            {
+                Crash c;
+                ok = (bool)(ss >> c.rid >> c.from >> c.to);
+                crashes.push_back(c);
+            }
+            else if (cmd == "delay")
+            {
+                Delay d;
+                ok = (bool)(ss >> d.from >> d.to >> d.extra);
+                delays.push_back(d);
+            }
+            else ok = false;
+            if (!ok) throw std::invalid_argument("invalid scenario line: " + line);
+        }
+    }
+};
+
+class VirtualClock: public PMClock {
+    using event_t = std::pair<double, uint64_t>;
+    double t_now;
+    uint64_t next_handle;
+    std::priority_queue<event_t, std::vector<event_t>, std::greater<event_t>> queue;
+    std::unordered_map<uint64_t, std::function<void()>> callbacks;
+
+    public:
+    VirtualClock(): t_now(0), next_handle(1) {}
+
+    double now() const override { return t_now; }
+
+    uint64_t schedule(double t_sec, std::function<void()> cb) override {
+        uint64_t handle = next_handle++;
+        callbacks.insert(std::make_pair(handle, std::move(cb)));
+        queue.push(std::make_pair(t_now + std::max(0.0, t_sec), handle));
+        return handle;
+    }
+
+    void cancel(uint64_t handle) override { callbacks.erase(handle); }
+
+    void run_until(double t_end) {
+        while (!queue.empty() && queue.top().first <= t_end)
+        {
+            auto e = queue.top();
+            queue.pop();
+            auto it = callbacks.find(e.second);
+            if (it == callbacks.end()) continue;
+            auto cb = std::move(it->second);
+            callbacks.erase(it);
+            t_now = e.first;
+            cb();
+        }
+        t_now = t_end;
+    }
+};
+
+class SimReplica;
+
+struct Sim {
+    const Scenario &sc;
+    VirtualClock clock;
+    std::vector<BoxObj<SimReplica>> reps;
+    /** arrival time of the last message on each link (links are FIFO) */
+    std::vector<double> link_last;
+    /** the replica the measurements are taken on */
+    ReplicaID observer;
+    std::vector<double> commit_times;
+    bool has_leader;
+    ReplicaID last_leader;
+    size_t nleader_changes;
+    size_t nimpeach;
+
+    Sim(const Scenario &sc, EventContext ec, const std::string &pmaker);
+    ~Sim();
+
+    void send(ReplicaID from, ReplicaID to, std::function<void(SimReplica &)> deliver);
+    /** Get the block at `dst`, copying it and its missing ancestors from
+     * `src` (fetching is instantaneous in the simulation). */
+    block_t fetch(ReplicaID dst, ReplicaID src, const uint256_t &blk_hash);
+    void run();
+};
+
+class SimReplica: public HotStuffCore {
+    Sim *sim;
+    uint64_t imp_handle;
+
+    void reset_imp_timer() {
+        sim->clock.cancel(imp_handle);
+        imp_handle = sim->clock.schedule(sim->sc.imp_timeout, [this]() {
+            sim->nimpeach++;
+            pmaker->impeach();
+            reset_imp_timer();
+        });
+    }
+
+    protected:
+    void do_broadcast_proposal(const Proposal &prop) override {
+        for (ReplicaID j = 0; j < sim->reps.size(); j++)
+        {
+            if (j == id) continue;
+            sim->send(id, j, [from=id, proposer=prop.proposer,
+                            blk_hash=prop.blk->get_hash()](SimReplica &r) {
+                r.recv_proposal(from, proposer, blk_hash);
+            });
+        }
+    }
+
+    void do_broadcast_flush_qc(const uint256_t &blk_hash, const QuorumCert &qc) override {
+        DataStream s;
+        s << qc;
+        bytearray_t raw(s.data(), s.data() + s.size());
+        for (ReplicaID j = 0; j < sim->reps.size(); j++)
+        {
+            if (j == id) continue;
+            sim->send(id, j, [from=id, blk_hash, raw](SimReplica &r) {
+                auto blk = r.sim->fetch(r.id, from, blk_hash);
+                if (!blk) return;
+                DataStream s(raw.data(), raw.data() + raw.size());
+                r.on_receive_flush_qc(blk, r.parse_quorum_cert(s));
+            });
+        }
+    }
+
+    void do_vote(ReplicaID last_proposer, const Vote &vote) override {
+        pmaker->beat_resp(last_proposer).then([this, vote](ReplicaID proposer) {
+            if (proposer == id)
+            {
+                on_receive_vote(vote);
+                return;
+            }
+            sim->send(id, proposer, [from=id, vote](SimReplica &r) {
+                if (!r.sim->fetch(r.id, from, vote.blk_hash)) return;
+                Vote v(vote);
+                v.hsc = &r;
+                r.on_receive_vote(v);
+            });
+        });
+    }
+
+    void do_decide(Finality &&) override {}
+
+    void do_consensus(const block_t &blk) override {
+        pmaker->on_consensus(blk);
+        if (id == sim->observer)
+            sim->commit_times.push_back(sim->clock.now());
+        reset_imp_timer();
+    }
+
+    part_cert_bt create_part_cert(const PrivKey &, const uint256_t &blk_hash) override {
+        return new PartCertDummy(blk_hash);
+    }
+
+    part_cert_bt parse_part_cert(DataStream &s) override {
+        PartCert *pc = new PartCertDummy();
+        s >> *pc;
+        return pc;
+    }
+
+    quorum_cert_bt create_quorum_cert(const uint256_t &blk_hash) override {
+        return new QuorumCertDummy(get_config(), blk_hash);
+    }
+
+    public:
+    pacemaker_bt pmaker;
+
+    SimReplica(ReplicaID id, Sim *sim, pacemaker_bt &&pmaker):
+        HotStuffCore(id, new PrivKeyDummy()),
+        sim(sim), imp_handle(0), pmaker(std::move(pmaker)) {}
+
+    quorum_cert_bt parse_quorum_cert(DataStream &s) override {
+        QuorumCert *qc = new QuorumCertDummy();
+        s >> *qc;
+        return qc;
+    }
+
+    /* no IRI to ask */
+    bool check_cmds(std::vector<uint256_t>) override { return true; }
+
+    void start() {
+        size_t n = sim->reps.size();
+        for (ReplicaID j = 0; j < n; j++)
+            add_replica(j, NetAddr(), new PubKeyDummy());
+        on_init((n - 1) / 3);
+        pmaker->set_clock(&sim->clock);
+        pmaker->init(this);
+        reset_imp_timer();
+    }
+
+    /* the same as HotStuffApp feeding a command */
+    void request_proposal() {
+        if (pmaker->get_proposer() != id || pmaker->get_pending_size()) return;
+        pmaker->beat().then([this](ReplicaID proposer) {
+            if (proposer == id)
+                on_propose(std::vector<uint256_t>{}, pmaker->get_parents());
+        });
+    }
+
+    void recv_proposal(ReplicaID from, ReplicaID proposer, const uint256_t &blk_hash) {
+        auto blk = sim->fetch(id, from, blk_hash);
+        if (!blk) return;
+        if (id == sim->observer)
+        {
+            if (sim->has_leader && proposer != sim->last_leader)
+                sim->nleader_changes++;
+            sim->has_leader = true;
+            sim->last_leader = proposer;
+        }
+        on_receive_proposal(Proposal(proposer, blk, this));
+    }
+
+    friend struct Sim;
+};
+
+static pacemaker_bt create_pmaker(const std::string &name, EventContext ec,
+                                const Scenario &sc) {
+    const int32_t parent_limit = -1;
+    if (name == "dummy")
+        return new PaceMakerDummyFixed(0, parent_limit);
+    if (name == "rr")
+        return new PaceMakerRR(ec, parent_limit, sc.base_timeout, sc.prop_delay);
+    if (name == "rr-adaptive")
+        return new PaceMakerRRAdaptive(ec, parent_limit, sc.base_timeout, sc.prop_delay,
+                                        0.99, 0.05, 10);
+    if (name == "rr-rep")
+        return new PaceMakerRRReputation(ec, parent_limit, sc.base_timeout, sc.prop_delay, 100);
+    if (name == "rr-block")
+        return new PaceMakerRotating(ec, parent_limit, sc.base_timeout);
+    throw std::invalid_argument("unknown pacemaker " + name);
+}
+
+Sim::Sim(const Scenario &sc, EventContext ec, const std::string &pmaker):
+        sc(sc), link_last(sc.nreplicas * sc.nreplicas, 0),
+        observer(0), has_leader(false), last_leader(0),
+        nleader_changes(0), nimpeach(0) {
+    for (ReplicaID i = 0; i < sc.nreplicas; i++)
+    {
+        bool crashes = false;
+        for (const auto &c: sc.crashes)
+            if (c.rid == i) crashes = true;
+        if (!crashes) observer = i;
+    }
+    for (ReplicaID i = 0; i < sc.nreplicas; i++)
+        reps.emplace_back(new SimReplica(i, this, create_pmaker(pmaker, ec, sc)));
+}
+
+Sim::~Sim() {
+    /* drop the pending callbacks before the replicas they refer to */
+    clock = VirtualClock();
+}
+
+void Sim::send(ReplicaID from, ReplicaID to, std::function<void(SimReplica &)> deliver) {
+    double now = clock.now();
+    if (sc.is_down(from, now)) return;
+    auto &last = link_last[from * sc.nreplicas + to];
+    last = std::max(now + sc.get_delay(now), last);
+    clock.schedule(last - now, [this, to, deliver]() {
+        if (!sc.is_down(to, clock.now())) deliver(*reps[to]);
+    });
+}
+
+block_t Sim::fetch(ReplicaID dst, ReplicaID src, const uint256_t &blk_hash) {
+    auto &r = *reps[dst];
+    block_t blk = r.storage->find_blk(blk_hash);
+    if (blk && blk->is_delivered()) return blk;
+    block_t sblk = reps[src]->storage->find_blk(blk_hash);
+    if (!sblk || !sblk->is_delivered()) return nullptr;
+    for (const auto &h: sblk->get_parent_hashes())
+        if (!fetch(dst, src, h)) return nullptr;
+    const auto &qc = sblk->get_qc();
+    if (qc && sblk->get_cmds().empty() && !fetch(dst, src, qc->get_obj_hash()))
+        return nullptr;
+    DataStream s;
+    s << *sblk;
+    blk = new Block();
+    blk->unserialize(s, &r);
+    blk = r.storage->add_blk(blk);
+    r.on_deliver_blk(blk);
+    return blk;
+}
+
+void Sim::run() {
+    for (auto &r: reps) r->start();
+    std::function<void()> tick;
+    tick = [this, &tick]() {
+        for (auto &r: reps)
+            if (!sc.is_down(r->get_id(), clock.now()))
+                r->request_proposal();
+        clock.schedule(sc.load, tick);
+    };
+    clock.schedule(0, tick);
+    clock.run_until(sc.duration);
+}
+
+int main(int argc, char **argv) {
+    Scenario sc;
+    if (argc > 1) sc.load_file(argv[1]);
+    Scenario baseline = sc;
+    baseline.crashes.clear();
+    baseline.delays.clear();
+    auto faults = sc.get_fault_times();
+    EventContext ec;
+
+    printf("# empty blocks only: the QC flush and rr-block's command flush "
+            "are not exercised\n");
+    printf("pacemaker,commits,baseline,tput_loss,crash_commits,leader_changes,"
+            "impeachments,max_gap,ttr_avg,ttr_max\n");
+    for (const char *name: {"dummy", "rr", "rr-adaptive", "rr-rep", "rr-block"})
+    {
+        size_t nbase;
+        {
+            Sim sim(baseline, ec, name);
+            sim.run();
+            nbase = sim.commit_times.size();
+        }
+        Sim sim(sc, ec, name);
+        sim.run();
+        const auto &ct = sim.commit_times;
+        double max_gap = ct.empty() ? sc.duration : ct.front();
+        for (size_t i = 1; i < ct.size(); i++)
+            max_gap = std::max(max_gap, ct[i] - ct[i - 1]);
+        if (!ct.empty())
+            max_gap = std::max(max_gap, sc.duration - ct.back());
+        size_t ncrash_commits = 0;
+        for (auto t: ct)
+            if (sc.is_any_down(t)) ncrash_commits++;
+        double ttr_sum = 0, ttr_max = 0;
+        bool recovered = true;
+        for (auto t: faults)
+        {
+            auto it = std::lower_bound(ct.begin(), ct.end(), t);
+            if (it == ct.end())
+            {
+                recovered = false;
+                continue;
+            }
+            ttr_sum += *it - t;
+            ttr_max = std::max(ttr_max, *it - t);
+        }
+        double ttr_avg = faults.empty() ? 0 : ttr_sum / faults.size();
+        if (!recovered) ttr_avg = ttr_max = -1;
+        printf("%s,%lu,%lu,%.3f,%lu,%lu,%lu,%.3f,%.3f,%.3f\n",
+                name, ct.size(), nbase,
+                nbase ? 1 - ct.size() / double(nbase) : 0,
+                ncrash_commits, sim.nleader_changes, sim.nimpeach,
+                max_gap, ttr_avg, ttr_max);
+        fflush(stdout);
+    }
+    return 0;
+}